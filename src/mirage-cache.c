@@ -0,0 +1,288 @@
+/* mirage2iso; decoded block cache
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <string.h>
+
+#include "mirage-cache.h"
+#include "mirage-wrapper.h"
+
+/* 32 sectors of 2048 bytes make a 64 KiB block */
+#define MIRAGECACHE_BLOCK_SECTORS 32
+/* read-ahead window grows up to this many blocks (2 MiB) */
+#define MIRAGECACHE_MAX_READAHEAD 32
+
+typedef struct {
+	guint64 index;
+	guint8 *data;
+	gboolean zero;
+	GList link;
+} miragecache_block_t;
+
+struct miragecache {
+	gint track_num;
+	gint sect_size;
+	gint sectors;
+	gsize block_size;
+	guint64 blocks;
+	guint max_blocks;
+
+	/* protects everything below */
+	GMutex lock;
+	GHashTable *table;
+	GQueue lru;
+
+	guint64 seq_next;
+	guint readahead;
+	guint64 ra_next, ra_end;
+	gboolean stop;
+	GCond ra_cond;
+	GThread *ra_thread;
+
+	/* libmirage objects can't be used concurrently */
+	GMutex decode_lock;
+};
+
+static void miragecache_block_free(gpointer data) {
+	miragecache_block_t* const block = data;
+
+	g_free(block->data);
+	g_free(block);
+}
+
+static miragecache_block_t* miragecache_decode(miragecache_t* const cache, const guint64 index) {
+	const gint first = index * MIRAGECACHE_BLOCK_SECTORS;
+	const gint count = MIN(MIRAGECACHE_BLOCK_SECTORS, cache->sectors - first);
+	miragecache_block_t* const block = g_new(miragecache_block_t, 1);
+	gsize i;
+	gboolean ret;
+
+	block->index = index;
+	block->data = g_malloc(cache->block_size);
+	block->link.data = block;
+	block->link.next = block->link.prev = NULL;
+
+	g_mutex_lock(&cache->decode_lock);
+	ret = miragewrap_read_sectors(cache->track_num, first, count, block->data);
+	g_mutex_unlock(&cache->decode_lock);
+
+	if (!ret) {
+		miragecache_block_free(block);
+		return NULL;
+	}
+
+	/* the last block may be partial */
+	if (count < MIRAGECACHE_BLOCK_SECTORS)
+		memset(&block->data[count * cache->sect_size], 0,
+				(MIRAGECACHE_BLOCK_SECTORS - count) * cache->sect_size);
+
+	block->zero = TRUE;
+	for (i = 0; i < cache->block_size && block->zero; i += sizeof(guint64))
+		block->zero = !*((guint64*) &block->data[i]);
+
+	return block;
+}
+
+/* Needs cache->lock held. Returns the block actually in cache. */
+static miragecache_block_t* miragecache_insert(miragecache_t* const cache, miragecache_block_t* block) {
+	miragecache_block_t* const old = g_hash_table_lookup(cache->table, &block->index);
+
+	/* decoded concurrently by another reader or by read-ahead */
+	if (old) {
+		miragecache_block_free(block);
+		return old;
+	}
+
+	g_hash_table_insert(cache->table, &block->index, block);
+	g_queue_push_head_link(&cache->lru, &block->link);
+
+	while (cache->lru.length > cache->max_blocks) {
+		miragecache_block_t* const victim = cache->lru.tail->data;
+
+		g_queue_unlink(&cache->lru, &victim->link);
+		g_hash_table_remove(cache->table, &victim->index);
+	}
+
+	return block;
+}
+
+/* Needs cache->lock held, may drop it temporarily. */
+static miragecache_block_t* miragecache_get(miragecache_t* const cache, const guint64 index) {
+	miragecache_block_t* block = g_hash_table_lookup(cache->table, &index);
+
+	if (block) {
+		g_queue_unlink(&cache->lru, &block->link);
+		g_queue_push_head_link(&cache->lru, &block->link);
+		return block;
+	}
+
+	g_mutex_unlock(&cache->lock);
+	block = miragecache_decode(cache, index);
+	g_mutex_lock(&cache->lock);
+
+	if (!block)
+		return NULL;
+	return miragecache_insert(cache, block);
+}
+
+static gpointer miragecache_readahead_thread(gpointer data) {
+	miragecache_t* const cache = data;
+
+	g_mutex_lock(&cache->lock);
+	while (!cache->stop) {
+		guint64 index;
+
+		if (cache->ra_next >= cache->ra_end) {
+			g_cond_wait(&cache->ra_cond, &cache->lock);
+			continue;
+		}
+
+		index = cache->ra_next++;
+		if (!g_hash_table_lookup(cache->table, &index)) {
+			miragecache_block_t *block;
+
+			g_mutex_unlock(&cache->lock);
+			block = miragecache_decode(cache, index);
+			g_mutex_lock(&cache->lock);
+
+			if (block)
+				miragecache_insert(cache, block);
+			else /* the foreground read will report the error */
+				cache->ra_end = cache->ra_next;
+		}
+	}
+	g_mutex_unlock(&cache->lock);
+
+	return NULL;
+}
+
+miragecache_t* miragecache_new(const gint track_num, const gsize max_bytes) {
+	miragecache_t *cache;
+	const gsize size = miragewrap_get_track_size(track_num);
+
+	if (size == 0)
+		return NULL;
+
+	cache = g_new0(miragecache_t, 1);
+	cache->track_num = track_num;
+	cache->sect_size = 2048;
+	cache->sectors = size / cache->sect_size;
+	cache->block_size = MIRAGECACHE_BLOCK_SECTORS * cache->sect_size;
+	cache->blocks = (cache->sectors + MIRAGECACHE_BLOCK_SECTORS - 1) / MIRAGECACHE_BLOCK_SECTORS;
+	/* keep room for the whole read-ahead window and the block being read */
+	cache->max_blocks = MAX(max_bytes / cache->block_size, MIRAGECACHE_MAX_READAHEAD + 2);
+
+	g_mutex_init(&cache->lock);
+	g_mutex_init(&cache->decode_lock);
+	g_cond_init(&cache->ra_cond);
+	g_queue_init(&cache->lru);
+	cache->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+			NULL, miragecache_block_free);
+
+	cache->ra_thread = g_thread_new("readahead", miragecache_readahead_thread, cache);
+
+	return cache;
+}
+
+guint64 miragecache_get_size(miragecache_t* const cache) {
+	return (guint64) cache->sectors * cache->sect_size;
+}
+
+gboolean miragecache_read(miragecache_t* const cache, guint8* const buf,
+		const gsize len, const guint64 offset) {
+	const guint64 first = offset / cache->block_size;
+	const guint64 last = (offset + len - 1) / cache->block_size;
+	guint64 i;
+	gsize done = 0;
+
+	if (len == 0)
+		return TRUE;
+	if (offset + len > miragecache_get_size(cache))
+		return FALSE;
+
+	g_mutex_lock(&cache->lock);
+
+	for (i = first; i <= last; i++) {
+		const miragecache_block_t* const block = miragecache_get(cache, i);
+		const gsize boff = i == first ? offset % cache->block_size : 0;
+		const gsize blen = MIN(cache->block_size - boff, len - done);
+
+		if (!block) {
+			g_mutex_unlock(&cache->lock);
+			return FALSE;
+		}
+
+		memcpy(&buf[done], &block->data[boff], blen);
+		done += blen;
+	}
+
+	/* reads continuing the previous one grow the read-ahead window,
+	 * anything else stops it */
+	if (first == cache->seq_next || first + 1 == cache->seq_next) {
+		cache->readahead = cache->readahead
+			? MIN(cache->readahead * 2, MIRAGECACHE_MAX_READAHEAD) : 1;
+		cache->ra_next = MAX(cache->ra_next, last + 1);
+		cache->ra_end = MIN(last + 1 + cache->readahead, cache->blocks);
+		g_cond_signal(&cache->ra_cond);
+	} else {
+		cache->readahead = 0;
+		cache->ra_next = cache->ra_end = 0;
+	}
+	cache->seq_next = last + 1;
+
+	g_mutex_unlock(&cache->lock);
+	return TRUE;
+}
+
+gboolean miragecache_get_zero_run(miragecache_t* const cache, const guint64 offset,
+		const guint64 len, guint64* const run_len, gboolean* const zero) {
+	const guint64 first = offset / cache->block_size;
+	guint64 i, end = offset + len;
+
+	if (len == 0 || end > miragecache_get_size(cache))
+		return FALSE;
+
+	g_mutex_lock(&cache->lock);
+
+	for (i = first; i * cache->block_size < end; i++) {
+		const miragecache_block_t* const block = miragecache_get(cache, i);
+
+		if (!block) {
+			g_mutex_unlock(&cache->lock);
+			return FALSE;
+		}
+
+		if (i == first)
+			*zero = block->zero;
+		else if (block->zero != *zero) {
+			end = i * cache->block_size;
+			break;
+		}
+	}
+
+	g_mutex_unlock(&cache->lock);
+
+	*run_len = end - offset;
+	return TRUE;
+}
+
+void miragecache_free(miragecache_t* const cache) {
+	g_mutex_lock(&cache->lock);
+	cache->stop = TRUE;
+	g_cond_signal(&cache->ra_cond);
+	g_mutex_unlock(&cache->lock);
+	g_thread_join(cache->ra_thread);
+
+	g_hash_table_destroy(cache->table);
+	g_cond_clear(&cache->ra_cond);
+	g_mutex_clear(&cache->decode_lock);
+	g_mutex_clear(&cache->lock);
+	g_free(cache);
+}
@@ -0,0 +1,21 @@
+/* mirage2iso; decoded block cache
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_CACHE_H
+#define _MIRAGE_CACHE_H 1
+
+#include <glib.h>
+
+typedef struct miragecache miragecache_t;
+
+miragecache_t* miragecache_new(const gint track_num, const gsize max_bytes);
+guint64 miragecache_get_size(miragecache_t* const cache);
+gboolean miragecache_read(miragecache_t* const cache, guint8* const buf,
+		const gsize len, const guint64 offset);
+gboolean miragecache_get_zero_run(miragecache_t* const cache, const guint64 offset,
+		const guint64 len, guint64* const run_len, gboolean* const zero);
+void miragecache_free(miragecache_t* const cache);
+
+#endif
@@ -0,0 +1,230 @@
+/* mirage2iso; --check-edc sector verification
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mirage-check.h"
+
+/* sectors handed to a verification thread at once */
+#define MIRAGECHECK_BATCH 64
+#define MIRAGECHECK_SECTOR_SIZE 2352
+
+typedef struct {
+	guint8 raw[MIRAGECHECK_BATCH][MIRAGECHECK_SECTOR_SIZE];
+	gint sector[MIRAGECHECK_BATCH];
+	mirageecc_type_t type[MIRAGECHECK_BATCH];
+	gint count;
+} miragecheck_batch_t;
+
+typedef struct {
+	gint sector;
+	mirageecc_status_t status;
+} miragecheck_bad_t;
+
+extern gboolean quiet;
+
+gboolean miragecheck_enabled = FALSE;
+static miragecheck_mode_t miragecheck_mode;
+
+static GThreadPool *miragecheck_pool = NULL;
+/* idle batches; when verification lags behind, the reader waits here */
+static GAsyncQueue *miragecheck_idle = NULL;
+static gint miragecheck_batches;
+static miragecheck_batch_t *miragecheck_current = NULL;
+/* repair needs the result before the data is written, so it is inline */
+static gboolean miragecheck_inline;
+static guint8 miragecheck_sector[MIRAGECHECK_SECTOR_SIZE];
+
+static GMutex miragecheck_lock;
+static GArray *miragecheck_bad = NULL;
+static guint64 miragecheck_checked;
+static guint64 miragecheck_skipped;
+
+void miragecheck_enable(const miragecheck_mode_t mode) {
+	miragecheck_enabled = TRUE;
+	miragecheck_mode = mode;
+	miragecheck_inline = mode == miragecheck_repair;
+	miragecheck_bad = g_array_new(FALSE, FALSE, sizeof(miragecheck_bad_t));
+}
+
+static void miragecheck_record(const gint sector, const mirageecc_status_t status) {
+	const miragecheck_bad_t bad = { sector, status };
+
+	g_array_append_val(miragecheck_bad, bad);
+}
+
+static void miragecheck_worker(gpointer data, gpointer user_data) {
+	miragecheck_batch_t* const batch = data;
+	const gboolean ecc = miragecheck_mode != miragecheck_edc;
+	gint i;
+
+	for (i = 0; i < batch->count; i++) {
+		const mirageecc_status_t status = mirageecc_verify(batch->raw[i], batch->type[i], ecc, FALSE);
+
+		if (status != mirageecc_ok) {
+			g_mutex_lock(&miragecheck_lock);
+			miragecheck_record(batch->sector[i], status);
+			g_mutex_unlock(&miragecheck_lock);
+		}
+	}
+
+	g_mutex_lock(&miragecheck_lock);
+	miragecheck_checked += batch->count;
+	g_mutex_unlock(&miragecheck_lock);
+
+	g_async_queue_push(miragecheck_idle, batch);
+}
+
+static gboolean miragecheck_start(void) {
+	GError *err = NULL;
+	const gint threads = g_get_num_processors();
+	gint i;
+
+	miragecheck_pool = g_thread_pool_new(&miragecheck_worker, NULL, threads, FALSE, &err);
+	if (!miragecheck_pool) {
+		g_printerr("Unable to start EDC/ECC check threads: %s\n", err->message);
+		g_error_free(err);
+		return FALSE;
+	}
+
+	miragecheck_idle = g_async_queue_new();
+	miragecheck_batches = 2 * threads;
+	for (i = 0; i < miragecheck_batches; i++)
+		g_async_queue_push(miragecheck_idle, g_new(miragecheck_batch_t, 1));
+
+	return TRUE;
+}
+
+/* Returns the buffer the next raw (2352-byte) sector should be put in. */
+guint8* miragecheck_slot(void) {
+	if (miragecheck_inline)
+		return miragecheck_sector;
+
+	if (!miragecheck_current) {
+		if (!miragecheck_pool && !miragecheck_start()) {
+			miragecheck_inline = TRUE;
+			return miragecheck_sector;
+		}
+
+		miragecheck_current = g_async_queue_pop(miragecheck_idle);
+		miragecheck_current->count = 0;
+	}
+
+	return miragecheck_current->raw[miragecheck_current->count];
+}
+
+/* Queues the sector put in the slot for verification. In repair mode,
+ * it is verified immediately, and if it was corrected, its user data
+ * is copied to data and TRUE is returned. */
+gboolean miragecheck_commit(const gint sector, const mirageecc_type_t type, guint8* const data) {
+	miragecheck_batch_t* const batch = miragecheck_current;
+
+	if (miragecheck_inline) {
+		const mirageecc_status_t status = mirageecc_verify(miragecheck_sector, type,
+				miragecheck_mode != miragecheck_edc, miragecheck_mode == miragecheck_repair);
+
+		miragecheck_checked++;
+		if (status == mirageecc_ok)
+			return FALSE;
+
+		miragecheck_record(sector, status);
+		if (status != mirageecc_repaired)
+			return FALSE;
+
+		memcpy(data, &miragecheck_sector[type == mirageecc_mode1 ? 16 : 24], 2048);
+		return TRUE;
+	}
+
+	batch->sector[batch->count] = sector;
+	batch->type[batch->count] = type;
+	if (++batch->count == MIRAGECHECK_BATCH) {
+		g_thread_pool_push(miragecheck_pool, batch, NULL);
+		miragecheck_current = NULL;
+	}
+
+	return FALSE;
+}
+
+/* Counts a sector which has no EDC/ECC stored in the image. */
+void miragecheck_skip(void) {
+	miragecheck_skipped++;
+}
+
+static gint miragecheck_compare(gconstpointer a, gconstpointer b) {
+	const miragecheck_bad_t* const x = a;
+	const miragecheck_bad_t* const y = b;
+
+	return x->sector < y->sector ? -1 : x->sector > y->sector;
+}
+
+/* Waits for the verification to finish and reports bad sectors.
+ * Returns the number of bad sectors that were not repaired. */
+gint miragecheck_report(FILE* const f) {
+	gint bad = 0, repaired = 0;
+	guint i;
+
+	if (!miragecheck_enabled)
+		return 0;
+
+	if (miragecheck_current) {
+		if (miragecheck_current->count)
+			g_thread_pool_push(miragecheck_pool, miragecheck_current, NULL);
+		else
+			g_async_queue_push(miragecheck_idle, miragecheck_current);
+		miragecheck_current = NULL;
+	}
+
+	if (miragecheck_pool) {
+		g_thread_pool_free(miragecheck_pool, FALSE, TRUE);
+		miragecheck_pool = NULL;
+
+		for (i = 0; i < (guint) miragecheck_batches; i++)
+			g_free(g_async_queue_pop(miragecheck_idle));
+		g_async_queue_unref(miragecheck_idle);
+		miragecheck_idle = NULL;
+	}
+
+	g_array_sort(miragecheck_bad, &miragecheck_compare);
+	for (i = 0; i < miragecheck_bad->len; i++) {
+		const miragecheck_bad_t* const b = &g_array_index(miragecheck_bad, miragecheck_bad_t, i);
+		const gchar *desc;
+
+		switch (b->status) {
+			case mirageecc_bad_edc:
+				desc = "EDC mismatch";
+				break;
+			case mirageecc_bad_ecc:
+				desc = "ECC mismatch";
+				break;
+			case mirageecc_repaired:
+				desc = "repaired using ECC";
+				repaired++;
+				break;
+			default:
+				desc = "unrepairable";
+		}
+
+		if (b->status != mirageecc_repaired)
+			bad++;
+		fprintf(f, "Sector %d: %s\n", b->sector, desc);
+	}
+
+	if (!quiet || bad)
+		fprintf(f, "EDC/ECC check: %" G_GUINT64_FORMAT " sectors verified, %" G_GUINT64_FORMAT
+				" without EDC/ECC, %d bad, %d repaired\n",
+				miragecheck_checked, miragecheck_skipped, bad, repaired);
+
+	g_array_free(miragecheck_bad, TRUE);
+	miragecheck_bad = NULL;
+	miragecheck_enabled = FALSE;
+	return bad;
+}
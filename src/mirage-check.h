@@ -0,0 +1,29 @@
+/* mirage2iso; --check-edc sector verification
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_CHECK_H
+#define _MIRAGE_CHECK_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "mirage-ecc.h"
+
+typedef enum {
+	miragecheck_edc = 1,
+	miragecheck_ecc,
+	miragecheck_repair
+} miragecheck_mode_t;
+
+extern gboolean miragecheck_enabled;
+
+void miragecheck_enable(const miragecheck_mode_t mode);
+guint8* miragecheck_slot(void);
+gboolean miragecheck_commit(const gint sector, const mirageecc_type_t type, guint8* const data);
+void miragecheck_skip(void);
+gint miragecheck_report(FILE* const f);
+
+#endif
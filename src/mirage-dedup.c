@@ -0,0 +1,501 @@
+/* mirage2iso; content-defined chunk store for --store and --restore
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+#include "mirage-dedup.h"
+#include "mirage-sysexits.h"
+
+extern gboolean quiet;
+extern gboolean verbose;
+
+#define MIRAGEDEDUP_MIN_SIZE (16 << 10)
+#define MIRAGEDEDUP_AVG_SIZE (64 << 10)
+#define MIRAGEDEDUP_MAX_SIZE (256 << 10)
+/* FastCDC-style normalized chunking: a harder mask below the average
+ * size and an easier one above it keep chunk sizes close to it */
+#define MIRAGEDEDUP_MASK_S G_GUINT64_CONSTANT(0xffffc00000000000) /* 18 bits */
+#define MIRAGEDEDUP_MASK_L G_GUINT64_CONSTANT(0xfffc000000000000) /* 14 bits */
+
+/* data waiting to be chunked; needs to hold at least one maximal chunk */
+#define MIRAGEDEDUP_CHUNK_BUF_SIZE (4 << 20)
+/* size of a single write when restoring */
+#define MIRAGEDEDUP_RESTORE_BUF_SIZE (8 << 20)
+
+#define MIRAGEDEDUP_RECIPE_MAGIC "mirage2iso-recipe 1"
+
+typedef struct {
+	gchar digest[65];
+	guint32 len;
+} miragededup_chunk_t;
+
+typedef struct {
+	guint index;
+	guint8 *data;
+	gsize len;
+} miragededup_job_t;
+
+struct miragededup {
+	gchar *store;
+
+	guint8 *buf;
+	gsize pos, fill;
+	guint next_index;
+	guint64 size;
+
+	GThreadPool *pool;
+	GMutex lock;
+	GCond done;
+	guint in_flight, max_in_flight;
+	gboolean failed;
+
+	/* digests of chunks already seen in this image */
+	GHashTable *seen;
+	GArray *chunks;
+	guint new_chunks;
+	guint64 new_bytes;
+	gint64 start;
+};
+
+struct miragededup_recipe {
+	GArray *chunks;
+	guint64 size;
+};
+
+static guint64 miragededup_gear[256];
+
+static void miragededup_init_gear(void) {
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		/* splitmix64, so that chunk boundaries never change */
+		guint64 x = G_GUINT64_CONSTANT(0x6d6972616765); /* 'mirage' */
+		gint i;
+
+		for (i = 0; i < 256; i++) {
+			guint64 z = (x += G_GUINT64_CONSTANT(0x9e3779b97f4a7c15));
+
+			z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+			z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT(0x94d049bb133111eb);
+			miragededup_gear[i] = z ^ (z >> 31);
+		}
+
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+/* Returns the length of the chunk starting at buf. Unless len is
+ * the rest of the image, it has to be at least MIRAGEDEDUP_MAX_SIZE. */
+static gsize miragededup_cut(const guint8* const buf, const gsize len) {
+	const gsize max = MIN(len, MIRAGEDEDUP_MAX_SIZE);
+	const gsize avg = MIN(max, MIRAGEDEDUP_AVG_SIZE);
+	guint64 h = 0;
+	gsize i;
+
+	/* The gear hash depends only on the last 64 bytes (older ones are
+	 * shifted out), so hashing can start right at the minimal size. */
+	for (i = MIRAGEDEDUP_MIN_SIZE; i < avg; i++) {
+		h = (h << 1) + miragededup_gear[buf[i]];
+		if (!(h & MIRAGEDEDUP_MASK_S))
+			return i + 1;
+	}
+	for (; i < max; i++) {
+		h = (h << 1) + miragededup_gear[buf[i]];
+		if (!(h & MIRAGEDEDUP_MASK_L))
+			return i + 1;
+	}
+
+	return max;
+}
+
+static gchar* miragededup_chunk_path(const gchar* const store, const gchar* const digest) {
+	const gchar dir[3] = { digest[0], digest[1], 0 };
+
+	return g_build_filename(store, dir, digest, NULL);
+}
+
+/* Returns 1 if the chunk was written, 0 if it was in the store already
+ * and -1 on error. */
+static gint miragededup_store_chunk(const gchar* const store, const gchar* const digest,
+		const guint8* const data, const gsize len) {
+	gchar* const fn = miragededup_chunk_path(store, digest);
+	gchar *dir;
+	GError *err = NULL;
+
+	if (g_file_test(fn, G_FILE_TEST_EXISTS)) {
+		g_free(fn);
+		return 0;
+	}
+
+	dir = g_path_get_dirname(fn);
+	if (g_mkdir_with_parents(dir, 0755)) {
+		g_printerr("Unable to create chunk store directory '%s': %s\n", dir, g_strerror(errno));
+		g_free(dir);
+		g_free(fn);
+		return -1;
+	}
+	g_free(dir);
+
+	/* written into a temporary file and renamed, so never partial */
+	if (!g_file_set_contents(fn, (const gchar*) data, len, &err)) {
+		g_printerr("Unable to store chunk: %s\n", err->message);
+		g_error_free(err);
+		g_free(fn);
+		return -1;
+	}
+
+	g_free(fn);
+	return 1;
+}
+
+static void miragededup_worker(gpointer data, gpointer user_data) {
+	miragededup_job_t* const job = data;
+	miragededup_t* const dd = user_data;
+	GChecksum* const sum = g_checksum_new(G_CHECKSUM_SHA256);
+	miragededup_chunk_t chunk;
+	gboolean is_new;
+	gint stored = 0;
+
+	g_checksum_update(sum, job->data, job->len);
+	g_strlcpy(chunk.digest, g_checksum_get_string(sum), sizeof(chunk.digest));
+	chunk.len = job->len;
+	g_checksum_free(sum);
+
+	g_mutex_lock(&dd->lock);
+	if (((is_new = !g_hash_table_contains(dd->seen, chunk.digest))))
+		g_hash_table_add(dd->seen, g_strdup(chunk.digest));
+	if (job->index >= dd->chunks->len)
+		g_array_set_size(dd->chunks, job->index + 1);
+	g_array_index(dd->chunks, miragededup_chunk_t, job->index) = chunk;
+	g_mutex_unlock(&dd->lock);
+
+	if (is_new)
+		stored = miragededup_store_chunk(dd->store, chunk.digest, job->data, job->len);
+
+	g_mutex_lock(&dd->lock);
+	if (stored == -1)
+		dd->failed = TRUE;
+	else if (stored) {
+		dd->new_chunks++;
+		dd->new_bytes += job->len;
+	}
+	dd->in_flight--;
+	g_cond_signal(&dd->done);
+	g_mutex_unlock(&dd->lock);
+
+	g_free(job->data);
+	g_free(job);
+}
+
+miragededup_t* miragededup_new(const gchar* const store) {
+	miragededup_t* const dd = g_new0(miragededup_t, 1);
+	const gint threads = g_get_num_processors();
+	GError *err = NULL;
+
+	miragededup_init_gear();
+
+	if (g_mkdir_with_parents(store, 0755)) {
+		g_printerr("Unable to create chunk store '%s': %s\n", store, g_strerror(errno));
+		g_free(dd);
+		return NULL;
+	}
+
+	dd->pool = g_thread_pool_new(&miragededup_worker, dd, threads, FALSE, &err);
+	if (!dd->pool) {
+		g_printerr("Unable to start chunk hashing threads: %s\n", err->message);
+		g_error_free(err);
+		g_free(dd);
+		return NULL;
+	}
+
+	dd->store = g_strdup(store);
+	dd->buf = g_malloc(MIRAGEDEDUP_CHUNK_BUF_SIZE);
+	g_mutex_init(&dd->lock);
+	g_cond_init(&dd->done);
+	dd->max_in_flight = 4 * threads;
+	dd->seen = g_hash_table_new_full(&g_str_hash, &g_str_equal, &g_free, NULL);
+	dd->chunks = g_array_new(FALSE, FALSE, sizeof(miragededup_chunk_t));
+	dd->start = g_get_monotonic_time();
+
+	return dd;
+}
+
+/* Passes the next len bytes of chunked data to the hashing threads. */
+static gboolean miragededup_emit(miragededup_t* const dd, const gsize len) {
+	miragededup_job_t* const job = g_new(miragededup_job_t, 1);
+	gboolean failed;
+
+	job->index = dd->next_index++;
+	job->data = g_malloc(len);
+	job->len = len;
+	memcpy(job->data, &dd->buf[dd->pos], len);
+	dd->pos += len;
+
+	g_mutex_lock(&dd->lock);
+	while (dd->in_flight >= dd->max_in_flight)
+		g_cond_wait(&dd->done, &dd->lock);
+	dd->in_flight++;
+	failed = dd->failed;
+	g_mutex_unlock(&dd->lock);
+
+	g_thread_pool_push(dd->pool, job, NULL);
+	return !failed;
+}
+
+/* miragewrap_write_func_t for miragewrap_output_track_to(). */
+gboolean miragededup_write(const guint8* const buf, const gsize len, gpointer user_data) {
+	miragededup_t* const dd = user_data;
+	gsize done = 0;
+
+	dd->size += len;
+	while (done < len) {
+		gsize n;
+
+		if (dd->fill == MIRAGEDEDUP_CHUNK_BUF_SIZE) {
+			memmove(dd->buf, &dd->buf[dd->pos], dd->fill - dd->pos);
+			dd->fill -= dd->pos;
+			dd->pos = 0;
+		}
+
+		n = MIN(len - done, MIRAGEDEDUP_CHUNK_BUF_SIZE - dd->fill);
+		memcpy(&dd->buf[dd->fill], &buf[done], n);
+		dd->fill += n;
+		done += n;
+
+		while (dd->fill - dd->pos >= MIRAGEDEDUP_MAX_SIZE) {
+			if (!miragededup_emit(dd, miragededup_cut(&dd->buf[dd->pos], dd->fill - dd->pos))) {
+				errno = EIO;
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean miragededup_write_recipe(miragededup_t* const dd, const gchar* const fn) {
+	FILE* const f = fn ? fopen(fn, "w") : stdout;
+	struct stat st;
+	gboolean ok, regular;
+	guint i;
+
+	if (!f) {
+		g_printerr("Unable to open recipe file: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	fprintf(f, MIRAGEDEDUP_RECIPE_MAGIC "\nsize %" G_GUINT64_FORMAT "\n", dd->size);
+	for (i = 0; i < dd->chunks->len; i++) {
+		const miragededup_chunk_t* const c = &g_array_index(dd->chunks, miragededup_chunk_t, i);
+
+		fprintf(f, "%s %u\n", c->digest, c->len);
+	}
+
+	/* the file is closed even if writing it failed already,
+	 * and removed then unless it is a device or a pipe */
+	ok = !ferror(f);
+	regular = fn && !fstat(fileno(f), &st) && S_ISREG(st.st_mode);
+	if (fn ? fclose(f) : fflush(f))
+		ok = FALSE;
+
+	if (!ok) {
+		g_printerr("Writing recipe failed: %s\n", g_strerror(errno));
+		if (regular && remove(fn))
+			g_printerr("remove() failed: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Chunks the rest of data, waits for all chunks to be stored
+ * and writes the recipe to fn (or stdout if NULL). */
+gint miragededup_finish(miragededup_t* const dd, const gchar* const recipe) {
+	gdouble elapsed;
+
+	while (dd->pos < dd->fill) {
+		if (!miragededup_emit(dd, miragededup_cut(&dd->buf[dd->pos], dd->fill - dd->pos)))
+			break;
+	}
+
+	g_thread_pool_free(dd->pool, FALSE, TRUE);
+	dd->pool = NULL;
+	if (dd->failed)
+		return EX_IOERR;
+
+	if (!miragededup_write_recipe(dd, recipe))
+		return EX_CANTCREAT;
+
+	elapsed = (g_get_monotonic_time() - dd->start) / 1e6;
+	if (!quiet) {
+		g_printerr("%u chunks (%" G_GUINT64_FORMAT " bytes), %u new (%" G_GUINT64_FORMAT " bytes) stored in %.1f s, %.1f MiB/s\n",
+				dd->chunks->len, dd->size, dd->new_chunks, dd->new_bytes,
+				elapsed, elapsed > 0 ? dd->size / elapsed / (1 << 20) : 0);
+		if (dd->new_bytes)
+			g_printerr("Dedup ratio: %.2f\n", (gdouble) dd->size / dd->new_bytes);
+		else
+			g_printerr("Dedup ratio: all data was in the store already\n");
+	}
+
+	return EX_OK;
+}
+
+void miragededup_free(miragededup_t* const dd) {
+	if (dd->pool)
+		g_thread_pool_free(dd->pool, FALSE, TRUE);
+
+	g_array_free(dd->chunks, TRUE);
+	g_hash_table_destroy(dd->seen);
+	g_cond_clear(&dd->done);
+	g_mutex_clear(&dd->lock);
+	g_free(dd->buf);
+	g_free(dd->store);
+	g_free(dd);
+}
+
+miragededup_recipe_t* miragededup_recipe_open(const gchar* const fn) {
+	miragededup_recipe_t *r;
+	gchar *contents;
+	gchar **lines;
+	guint64 total = 0;
+	GError *err = NULL;
+	gint i;
+
+	if (!g_file_get_contents(fn, &contents, NULL, &err)) {
+		g_printerr("Unable to read recipe: %s\n", err->message);
+		g_error_free(err);
+		return NULL;
+	}
+
+	lines = g_strsplit(contents, "\n", -1);
+	g_free(contents);
+
+	r = g_new(miragededup_recipe_t, 1);
+	r->chunks = g_array_new(FALSE, FALSE, sizeof(miragededup_chunk_t));
+	if (!lines[0] || strcmp(lines[0], MIRAGEDEDUP_RECIPE_MAGIC) || !lines[1]
+			|| sscanf(lines[1], "size %" G_GUINT64_FORMAT, &r->size) != 1)
+		i = 0;
+	else {
+		for (i = 2; lines[i] && *lines[i]; i++) {
+			miragededup_chunk_t c;
+
+			/* the digest becomes a path, so accept only hex digits */
+			if (sscanf(lines[i], "%64[0-9a-f] %u", c.digest, &c.len) != 2
+					|| strlen(c.digest) != 64 || !c.len || c.len > MIRAGEDEDUP_MAX_SIZE)
+				break;
+
+			g_array_append_val(r->chunks, c);
+			total += c.len;
+		}
+	}
+
+	if (!i || (lines[i] && *lines[i]) || total != r->size) {
+		g_printerr("'%s' is not a valid mirage2iso recipe\n", fn);
+		g_strfreev(lines);
+		miragededup_recipe_free(r);
+		return NULL;
+	}
+
+	g_strfreev(lines);
+	return r;
+}
+
+guint64 miragededup_recipe_get_size(miragededup_recipe_t* const r) {
+	return r->size;
+}
+
+/* Reassembles the image, verifying each chunk. Chunks are read straight
+ * into a large buffer, so that the output is written sequentially in
+ * big pieces. */
+gint miragededup_restore(miragededup_recipe_t* const r, const gchar* const store, FILE* const out,
+		void (*report_progress)(gint, gint, gint)) {
+	guint8* const buf = g_malloc(MIRAGEDEDUP_RESTORE_BUF_SIZE);
+	GChecksum* const sum = g_checksum_new(G_CHECKSUM_SHA256);
+	gsize fill = 0;
+	guint64 written = 0;
+	/* no progress for images smaller than a sector, it would divide by 0 */
+	const gint sect_max = r->size / 2048;
+	const gboolean progress = !quiet && sect_max;
+	gint ret = EX_OK;
+	guint i;
+
+	if (progress)
+		report_progress(-1, 0, sect_max);
+
+	for (i = 0; ret == EX_OK && i <= r->chunks->len; i++) {
+		const miragededup_chunk_t* const c = i < r->chunks->len
+			? &g_array_index(r->chunks, miragededup_chunk_t, i) : NULL;
+
+		if (fill && (!c || fill + c->len > MIRAGEDEDUP_RESTORE_BUF_SIZE)) {
+			if (fwrite(buf, 1, fill, out) != fill) {
+				if (progress)
+					report_progress(-1, 0, 0);
+				g_printerr("Write failed: %s\n", g_strerror(errno));
+				ret = EX_IOERR;
+				break;
+			}
+
+			written += fill;
+			fill = 0;
+			if (progress)
+				report_progress(0, written / 2048, sect_max);
+		}
+
+		if (c) {
+			gchar* const fn = miragededup_chunk_path(store, c->digest);
+			FILE* const f = fopen(fn, "rb");
+
+			if (!f) {
+				if (progress)
+					report_progress(-1, 0, 0);
+				g_printerr("Unable to open chunk '%s': %s\n", fn, g_strerror(errno));
+				ret = EX_NOINPUT;
+			} else {
+				if (fread(&buf[fill], 1, c->len, f) != c->len || fgetc(f) != EOF)
+					ret = EX_DATAERR;
+				else {
+					g_checksum_reset(sum);
+					g_checksum_update(sum, &buf[fill], c->len);
+					if (strcmp(g_checksum_get_string(sum), c->digest))
+						ret = EX_DATAERR;
+				}
+				fclose(f);
+
+				if (ret != EX_OK) {
+					if (progress)
+						report_progress(-1, 0, 0);
+					g_printerr("Chunk '%s' is damaged\n", fn);
+				}
+			}
+
+			fill += c->len;
+			g_free(fn);
+		}
+	}
+
+	if (ret == EX_OK && progress)
+		report_progress(-1, 0, 0);
+	if (ret == EX_OK && verbose)
+		g_printerr("%" G_GUINT64_FORMAT " bytes restored from %u chunks\n", written, r->chunks->len);
+
+	g_checksum_free(sum);
+	g_free(buf);
+	return ret;
+}
+
+void miragededup_recipe_free(miragededup_recipe_t* const r) {
+	g_array_free(r->chunks, TRUE);
+	g_free(r);
+}
@@ -0,0 +1,27 @@
+/* mirage2iso; content-defined chunk store for --store and --restore
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_DEDUP_H
+#define _MIRAGE_DEDUP_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef struct miragededup miragededup_t;
+typedef struct miragededup_recipe miragededup_recipe_t;
+
+miragededup_t* miragededup_new(const gchar* const store);
+gboolean miragededup_write(const guint8* const buf, const gsize len, gpointer user_data);
+gint miragededup_finish(miragededup_t* const dd, const gchar* const recipe);
+void miragededup_free(miragededup_t* const dd);
+
+miragededup_recipe_t* miragededup_recipe_open(const gchar* const fn);
+guint64 miragededup_recipe_get_size(miragededup_recipe_t* const r);
+gint miragededup_restore(miragededup_recipe_t* const r, const gchar* const store, FILE* const out,
+		void (*report_progress)(gint, gint, gint));
+void miragededup_recipe_free(miragededup_recipe_t* const r);
+
+#endif
@@ -0,0 +1,413 @@
+/* mirage2iso; CD-ROM EDC/ECC support
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#	define MIRAGEECC_X86 1
+#	include <emmintrin.h>
+#	include <wmmintrin.h>
+#endif
+
+#include "mirage-ecc.h"
+
+/* GF(2^8) with x^8 + x^4 + x^3 + x^2 + 1, EDC polynomial as in ECMA-130 */
+#define MIRAGEECC_GF_POLY 0x11d
+#define MIRAGEECC_EDC_POLY 0xd8018001
+
+/* P codewords are the 86 byte columns of 26 rows (24 + parity) starting
+ * at the header; Q codewords are 52 diagonals of 45 bytes (43 + parity) */
+#define MIRAGEECC_P_COLS 86
+#define MIRAGEECC_P_ROWS 26
+#define MIRAGEECC_Q_COUNT 52
+#define MIRAGEECC_Q_LEN 45
+
+static guint8 mirageecc_f_lut[256];
+static guint8 mirageecc_b_lut[256];
+static guint8 mirageecc_log[256];
+static guint32 mirageecc_edc_lut[256];
+static guint16 mirageecc_q_index[MIRAGEECC_Q_COUNT][MIRAGEECC_Q_LEN];
+static gboolean mirageecc_have_clmul;
+
+static void mirageecc_init_tables(void) {
+	static gsize initialized = 0;
+
+	if (g_once_init_enter(&initialized)) {
+		guint32 i, k;
+
+		for (i = 0; i < 256; i++) {
+			const guint32 j = (i << 1) ^ (i & 0x80 ? MIRAGEECC_GF_POLY : 0);
+			guint32 edc = i;
+
+			mirageecc_f_lut[i] = j;
+			mirageecc_b_lut[i ^ j] = i;
+
+			for (k = 0; k < 8; k++)
+				edc = (edc >> 1) ^ (edc & 1 ? MIRAGEECC_EDC_POLY : 0);
+			mirageecc_edc_lut[i] = edc;
+		}
+
+		for (i = 0, k = 1; i < 255; i++, k = mirageecc_f_lut[k])
+			mirageecc_log[k] = i;
+
+		/* byte offsets relative to the header, as walked by the encoder */
+		for (i = 0; i < MIRAGEECC_Q_COUNT; i++) {
+			guint32 index = (i >> 1) * 86 + (i & 1);
+
+			for (k = 0; k < MIRAGEECC_Q_LEN - 2; k++) {
+				mirageecc_q_index[i][k] = index;
+				index += 88;
+				if (index >= 2236)
+					index -= 2236;
+			}
+			mirageecc_q_index[i][k] = 2236 + i;
+			mirageecc_q_index[i][k + 1] = 2236 + MIRAGEECC_Q_COUNT + i;
+		}
+
+#ifdef MIRAGEECC_X86
+		mirageecc_have_clmul = __builtin_cpu_supports("pclmul");
+#endif
+
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+#ifdef MIRAGEECC_X86
+/* Folding constants for the bit-reflected EDC polynomial, computed like
+ * the ones for CRC-32 in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ": (x^n mod P) reflected and shifted left. */
+#define MIRAGEECC_K1 0x1f8931102ULL /* n = 4 * 128 + 32 */
+#define MIRAGEECC_K2 0x12e7928a2ULL /* n = 4 * 128 - 32 */
+#define MIRAGEECC_K3 0x06c90c100ULL /* n = 128 + 32 */
+#define MIRAGEECC_K4 0x1d5934102ULL /* n = 128 - 32 */
+#define MIRAGEECC_K5 0x1f1030002ULL /* n = 64 */
+#define MIRAGEECC_MU 0x17000ffffULL /* x^64 / P, reflected */
+#define MIRAGEECC_PX 0x1b0030003ULL /* P, reflected */
+
+__attribute__((target("pclmul")))
+static __m128i mirageecc_fold(const __m128i x, const __m128i k, const __m128i data) {
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+				_mm_clmulepi64_si128(x, k, 0x11)), data);
+}
+
+/* len needs to be a multiple of 16, at least 64 */
+__attribute__((target("pclmul")))
+static guint32 mirageecc_edc_clmul(const guint32 edc, const guint8* p, gsize len) {
+	const __m128i k1k2 = _mm_set_epi64x(MIRAGEECC_K2, MIRAGEECC_K1);
+	const __m128i k3k4 = _mm_set_epi64x(MIRAGEECC_K4, MIRAGEECC_K3);
+	const __m128i k5 = _mm_set_epi64x(0, MIRAGEECC_K5);
+	const __m128i poly = _mm_set_epi64x(MIRAGEECC_MU, MIRAGEECC_PX);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x0, x1, x2, x3, t;
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*) p), _mm_cvtsi32_si128(edc));
+	x1 = _mm_loadu_si128((const __m128i*) &p[16]);
+	x2 = _mm_loadu_si128((const __m128i*) &p[32]);
+	x3 = _mm_loadu_si128((const __m128i*) &p[48]);
+
+	for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+		x0 = mirageecc_fold(x0, k1k2, _mm_loadu_si128((const __m128i*) p));
+		x1 = mirageecc_fold(x1, k1k2, _mm_loadu_si128((const __m128i*) &p[16]));
+		x2 = mirageecc_fold(x2, k1k2, _mm_loadu_si128((const __m128i*) &p[32]));
+		x3 = mirageecc_fold(x3, k1k2, _mm_loadu_si128((const __m128i*) &p[48]));
+	}
+
+	x0 = mirageecc_fold(x0, k3k4, x1);
+	x0 = mirageecc_fold(x0, k3k4, x2);
+	x0 = mirageecc_fold(x0, k3k4, x3);
+	for (; len >= 16; p += 16, len -= 16)
+		x0 = mirageecc_fold(x0, k3k4, _mm_loadu_si128((const __m128i*) p));
+
+	/* 128 -> 64 -> 32 bits, then Barrett reduction */
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k3k4, 0x10), _mm_srli_si128(x0, 8));
+	t = _mm_srli_si128(x0, 4);
+	x0 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00), t);
+	t = x0;
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+	x0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x00);
+	x0 = _mm_xor_si128(x0, t);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x0, 4));
+}
+#endif
+
+guint32 mirageecc_edc(guint32 edc, const guint8* const buf, gsize len) {
+	const guint8 *p = buf;
+
+	mirageecc_init_tables();
+
+#ifdef MIRAGEECC_X86
+	if (mirageecc_have_clmul && len >= 64) {
+		const gsize n = len & ~(gsize) 15;
+
+		edc = mirageecc_edc_clmul(edc, p, n);
+		p += n;
+		len -= n;
+	}
+#endif
+
+	while (len--)
+		edc = (edc >> 8) ^ mirageecc_edc_lut[(edc ^ *p++) & 0xff];
+
+	return edc;
+}
+
+static void mirageecc_put_edc(guint8* const p, const guint32 edc) {
+	p[0] = edc;
+	p[1] = edc >> 8;
+	p[2] = edc >> 16;
+	p[3] = edc >> 24;
+}
+
+/* Computes one set of parity bytes (P or Q) over the 2064 bytes
+ * starting at the sector header. */
+static void mirageecc_compute_block(const guint8* const src, const guint32 major_count,
+		const guint32 minor_count, const guint32 major_mult, const guint32 minor_inc,
+		guint8* const dest) {
+	const guint32 size = major_count * minor_count;
+	guint32 major, minor;
+
+	for (major = 0; major < major_count; major++) {
+		guint32 index = (major >> 1) * major_mult + (major & 1);
+		guint8 ecc_a = 0, ecc_b = 0;
+
+		for (minor = 0; minor < minor_count; minor++) {
+			const guint8 temp = src[index];
+
+			index += minor_inc;
+			if (index >= size)
+				index -= size;
+			ecc_a ^= temp;
+			ecc_b ^= temp;
+			ecc_a = mirageecc_f_lut[ecc_a];
+		}
+
+		ecc_a = mirageecc_b_lut[mirageecc_f_lut[ecc_a] ^ ecc_b];
+		dest[major] = ecc_a;
+		dest[major + major_count] = ecc_a ^ ecc_b;
+	}
+}
+
+static void mirageecc_generate_pq(guint8* const sector, const gboolean zero_address) {
+	guint8 address[4];
+
+	/* Mode 2 ECC is computed with the header zeroed */
+	if (zero_address) {
+		memcpy(address, &sector[12], 4);
+		memset(&sector[12], 0, 4);
+	}
+
+	mirageecc_compute_block(&sector[12], 86, 24, 2, 86, &sector[2076]);
+	mirageecc_compute_block(&sector[12], 52, 43, 86, 88, &sector[2248]);
+
+	if (zero_address)
+		memcpy(&sector[12], address, 4);
+}
+
+/* Fills in EDC/ECC of a full 2352-byte sector. For Mode 2 sectors,
+ * the subheader has to be at 16 already. */
+void mirageecc_generate(guint8* const sector, const mirageecc_type_t type) {
+	mirageecc_init_tables();
+
+	switch (type) {
+		case mirageecc_mode1:
+			mirageecc_put_edc(&sector[2064], mirageecc_edc(0, sector, 2064));
+			memset(&sector[2068], 0, 8);
+			mirageecc_generate_pq(sector, FALSE);
+			break;
+		case mirageecc_mode2_form1:
+			mirageecc_put_edc(&sector[2072], mirageecc_edc(0, &sector[16], 2056));
+			mirageecc_generate_pq(sector, TRUE);
+			break;
+		case mirageecc_mode2_form2:
+			mirageecc_put_edc(&sector[2348], mirageecc_edc(0, &sector[16], 2332));
+			break;
+	}
+}
+
+static guint32 mirageecc_get_edc(const guint8* const p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+static gboolean mirageecc_check_edc(const guint8* const sector, const mirageecc_type_t type) {
+	switch (type) {
+		case mirageecc_mode1:
+			return mirageecc_get_edc(&sector[2064]) == mirageecc_edc(0, sector, 2064);
+		case mirageecc_mode2_form1:
+			return mirageecc_get_edc(&sector[2072]) == mirageecc_edc(0, &sector[16], 2056);
+		case mirageecc_mode2_form2:
+			/* EDC is optional in Form 2 */
+			return !mirageecc_get_edc(&sector[2348])
+				|| mirageecc_get_edc(&sector[2348]) == mirageecc_edc(0, &sector[16], 2332);
+	}
+
+	return FALSE;
+}
+
+#ifdef MIRAGEECC_X86
+static __m128i mirageecc_xtime(const __m128i v) {
+	const __m128i carry = _mm_cmpgt_epi8(_mm_setzero_si128(), v);
+
+	return _mm_xor_si128(_mm_add_epi8(v, v), _mm_and_si128(carry, _mm_set1_epi8(0x1d)));
+}
+#endif
+
+/* Checks the P syndromes (sum and weighted sum) of all columns; s points
+ * to the header. 16 columns at a time, the last block overlaps. */
+static gboolean mirageecc_check_p(const guint8* const s) {
+#ifdef MIRAGEECC_X86
+	gint c, r;
+
+	for (c = 0; c < MIRAGEECC_P_COLS; c += 16) {
+		const gint col = MIN(c, MIRAGEECC_P_COLS - 16);
+		__m128i s0 = _mm_setzero_si128(), s1 = _mm_setzero_si128();
+
+		for (r = 0; r < MIRAGEECC_P_ROWS; r++) {
+			const __m128i v = _mm_loadu_si128((const __m128i*) &s[col + MIRAGEECC_P_COLS * r]);
+
+			s0 = _mm_xor_si128(s0, v);
+			s1 = _mm_xor_si128(mirageecc_xtime(s1), v);
+		}
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(s0, s1), _mm_setzero_si128())) != 0xffff)
+			return FALSE;
+	}
+#else
+	gint c, r;
+
+	for (c = 0; c < MIRAGEECC_P_COLS; c++) {
+		guint8 s0 = 0, s1 = 0;
+
+		for (r = 0; r < MIRAGEECC_P_ROWS; r++) {
+			s0 ^= s[c + MIRAGEECC_P_COLS * r];
+			s1 = mirageecc_f_lut[s1] ^ s[c + MIRAGEECC_P_COLS * r];
+		}
+
+		if (s0 || s1)
+			return FALSE;
+	}
+#endif
+
+	return TRUE;
+}
+
+static void mirageecc_q_syndromes(const guint8* const s, const gint q, guint8* const s0, guint8* const s1) {
+	gint i;
+
+	*s0 = *s1 = 0;
+	for (i = 0; i < MIRAGEECC_Q_LEN; i++) {
+		const guint8 v = s[mirageecc_q_index[q][i]];
+
+		*s0 ^= v;
+		*s1 = mirageecc_f_lut[*s1] ^ v;
+	}
+}
+
+static gboolean mirageecc_check_q(const guint8* const s) {
+	gint q;
+
+	for (q = 0; q < MIRAGEECC_Q_COUNT; q++) {
+		guint8 s0, s1;
+
+		mirageecc_q_syndromes(s, q, &s0, &s1);
+		if (s0 || s1)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Locates and fixes a single error in a codeword of n bytes, given
+ * its syndromes. Returns the position fixed, or -1. */
+static gint mirageecc_locate(const guint8 s0, const guint8 s1, const gint n) {
+	gint pos;
+
+	if (!s0 || !s1)
+		return -1;
+
+	pos = n - 1 - (mirageecc_log[s1] - mirageecc_log[s0] + 255) % 255;
+	return pos >= 0 ? pos : -1;
+}
+
+/* Alternates single-error correction of P and Q codewords. */
+static gboolean mirageecc_correct(guint8* const s) {
+	gint round;
+
+	for (round = 0; round < 4; round++) {
+		gboolean fixed = FALSE;
+		gint c, r, q;
+
+		for (c = 0; c < MIRAGEECC_P_COLS; c++) {
+			guint8 s0 = 0, s1 = 0;
+
+			for (r = 0; r < MIRAGEECC_P_ROWS; r++) {
+				s0 ^= s[c + MIRAGEECC_P_COLS * r];
+				s1 = mirageecc_f_lut[s1] ^ s[c + MIRAGEECC_P_COLS * r];
+			}
+
+			if (((r = mirageecc_locate(s0, s1, MIRAGEECC_P_ROWS))) != -1) {
+				s[c + MIRAGEECC_P_COLS * r] ^= s0;
+				fixed = TRUE;
+			}
+		}
+
+		for (q = 0; q < MIRAGEECC_Q_COUNT; q++) {
+			guint8 s0, s1;
+
+			mirageecc_q_syndromes(s, q, &s0, &s1);
+			if (((r = mirageecc_locate(s0, s1, MIRAGEECC_Q_LEN))) != -1) {
+				s[mirageecc_q_index[q][r]] ^= s0;
+				fixed = TRUE;
+			}
+		}
+
+		if (!fixed)
+			break;
+	}
+
+	return mirageecc_check_p(s) && mirageecc_check_q(s);
+}
+
+/* Verifies EDC and, if ecc or repair is set, P/Q parity of a full
+ * 2352-byte sector. With repair, errors are corrected in place. */
+mirageecc_status_t mirageecc_verify(guint8* const sector, const mirageecc_type_t type,
+		const gboolean ecc, const gboolean repair) {
+	const gboolean edc_ok = mirageecc_check_edc(sector, type);
+	gboolean ecc_ok = TRUE, fixed = FALSE;
+	guint8 address[4] = { 0 };
+
+	mirageecc_init_tables();
+
+	if (type == mirageecc_mode2_form2)
+		return edc_ok ? mirageecc_ok : mirageecc_bad_edc;
+	if (edc_ok && !ecc && !repair)
+		return mirageecc_ok;
+
+	/* Mode 2 parity is computed with the header zeroed */
+	if (type == mirageecc_mode2_form1) {
+		memcpy(address, &sector[12], 4);
+		memset(&sector[12], 0, 4);
+	}
+
+	ecc_ok = mirageecc_check_p(&sector[12]) && mirageecc_check_q(&sector[12]);
+	if (repair && (!edc_ok || !ecc_ok))
+		fixed = mirageecc_correct(&sector[12]);
+
+	if (type == mirageecc_mode2_form1)
+		memcpy(&sector[12], address, 4);
+
+	if (edc_ok && ecc_ok)
+		return mirageecc_ok;
+	if (!repair)
+		return edc_ok ? mirageecc_bad_ecc : mirageecc_bad_edc;
+
+	return fixed && mirageecc_check_edc(sector, type) ? mirageecc_repaired : mirageecc_unrepairable;
+}
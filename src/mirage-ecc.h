@@ -0,0 +1,31 @@
+/* mirage2iso; CD-ROM EDC/ECC support
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_ECC_H
+#define _MIRAGE_ECC_H 1
+
+#include <glib.h>
+
+/* sector layouts, as used by ECM */
+typedef enum {
+	mirageecc_mode1 = 1, /* 2352 bytes, sync + header + data + EDC/ECC */
+	mirageecc_mode2_form1, /* 2336 bytes, subheader + data + EDC/ECC */
+	mirageecc_mode2_form2 /* 2336 bytes, subheader + data + EDC */
+} mirageecc_type_t;
+
+typedef enum {
+	mirageecc_ok,
+	mirageecc_bad_edc,
+	mirageecc_bad_ecc,
+	mirageecc_repaired,
+	mirageecc_unrepairable
+} mirageecc_status_t;
+
+guint32 mirageecc_edc(guint32 edc, const guint8* const buf, gsize len);
+void mirageecc_generate(guint8* const sector, const mirageecc_type_t type);
+mirageecc_status_t mirageecc_verify(guint8* const sector, const mirageecc_type_t type,
+		const gboolean ecc, const gboolean repair);
+
+#endif
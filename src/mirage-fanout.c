@@ -0,0 +1,234 @@
+/* mirage2iso; writing a single conversion into multiple outputs
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <signal.h>
+
+#include "mirage-fanout.h"
+#include "mirage-sysexits.h"
+
+#define MIRAGEFANOUT_BUFFER_SIZE (1 << 20)
+/* the slowest output can fall this many buffers behind the decoder */
+#define MIRAGEFANOUT_BUFFERS 8
+
+/* Shared by all outputs; returns to the pool when all of them wrote it. */
+typedef struct {
+	guint8 *data;
+	gsize len;
+	gint refs;
+} miragefanout_buffer_t;
+
+typedef struct {
+	miragefanout_t *fo;
+	FILE *f;
+	gchar *fn; /* NULL for stdout */
+	GAsyncQueue *queue;
+	GThread *thread;
+	/* errno of the first failed write, 0 if none */
+	gint error;
+} miragefanout_sink_t;
+
+struct miragefanout {
+	GPtrArray *sinks;
+	GAsyncQueue *idle;
+	miragefanout_buffer_t *current;
+	/* SIGPIPE is ignored while writing, restored when done */
+	struct sigaction sigpipe;
+};
+
+/* queued after the last buffer to stop a writer */
+static miragefanout_buffer_t miragefanout_eof;
+
+miragefanout_t* miragefanout_new(void) {
+	miragefanout_t* const fo = g_new0(miragefanout_t, 1);
+	struct sigaction sa;
+	gint i;
+
+	/* a pipe closed early fails only its output (with EPIPE) */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, &fo->sigpipe);
+
+	fo->sinks = g_ptr_array_new();
+	fo->idle = g_async_queue_new();
+	for (i = 0; i < MIRAGEFANOUT_BUFFERS; i++) {
+		miragefanout_buffer_t* const b = g_new(miragefanout_buffer_t, 1);
+
+		b->data = g_malloc(MIRAGEFANOUT_BUFFER_SIZE);
+		g_async_queue_push(fo->idle, b);
+	}
+
+	return fo;
+}
+
+static gpointer miragefanout_writer(gpointer data) {
+	miragefanout_sink_t* const s = data;
+	miragefanout_buffer_t *b;
+
+	while ((b = g_async_queue_pop(s->queue)) != &miragefanout_eof) {
+		/* a failed output keeps releasing buffers so that others go on */
+		if (!g_atomic_int_get(&s->error) && fwrite(b->data, 1, b->len, s->f) != b->len)
+			g_atomic_int_set(&s->error, ferror(s->f) && errno ? errno : EIO);
+
+		if (g_atomic_int_dec_and_test(&b->refs))
+			g_async_queue_push(s->fo->idle, b);
+	}
+
+	return NULL;
+}
+
+/* Adds an output, already set up with stdio_open(); fn is NULL for stdout.
+ * The file is closed by miragefanout_finish() or miragefanout_free(). */
+void miragefanout_add(miragefanout_t* const fo, FILE* const f, const gchar* const fn) {
+	miragefanout_sink_t* const s = g_new0(miragefanout_sink_t, 1);
+
+	s->fo = fo;
+	s->f = f;
+	s->fn = g_strdup(fn);
+	s->queue = g_async_queue_new();
+	s->thread = g_thread_new("fanout", &miragefanout_writer, s);
+	g_ptr_array_add(fo->sinks, s);
+}
+
+/* Passes the current buffer to all the writers. Fails (with errno set)
+ * when none of them is left. */
+static gboolean miragefanout_dispatch(miragefanout_t* const fo) {
+	miragefanout_buffer_t* const b = fo->current;
+	gint error = 0;
+	guint i;
+
+	fo->current = NULL;
+	b->refs = fo->sinks->len;
+	for (i = 0; i < fo->sinks->len; i++) {
+		miragefanout_sink_t* const s = g_ptr_array_index(fo->sinks, i);
+		const gint serr = g_atomic_int_get(&s->error);
+
+		if (!serr)
+			error = -1;
+		else if (!error)
+			error = serr;
+		g_async_queue_push(s->queue, b);
+	}
+
+	if (error > 0) {
+		errno = error;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* miragewrap_write_func_t; blocks while the slowest output holds all the buffers. */
+gboolean miragefanout_write(const guint8* const buf, const gsize len, gpointer user_data) {
+	miragefanout_t* const fo = user_data;
+	gsize pos = 0;
+
+	while (pos < len) {
+		gsize n;
+
+		if (!fo->current) {
+			fo->current = g_async_queue_pop(fo->idle);
+			fo->current->len = 0;
+		}
+
+		n = MIN(len - pos, MIRAGEFANOUT_BUFFER_SIZE - fo->current->len);
+		memcpy(&fo->current->data[fo->current->len], &buf[pos], n);
+		fo->current->len += n;
+		pos += n;
+
+		if (fo->current->len == MIRAGEFANOUT_BUFFER_SIZE && !miragefanout_dispatch(fo))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void miragefanout_join(miragefanout_t* const fo) {
+	guint i;
+
+	for (i = 0; i < fo->sinks->len; i++) {
+		miragefanout_sink_t* const s = g_ptr_array_index(fo->sinks, i);
+
+		if (s->thread)
+			g_async_queue_push(s->queue, &miragefanout_eof);
+	}
+
+	for (i = 0; i < fo->sinks->len; i++) {
+		miragefanout_sink_t* const s = g_ptr_array_index(fo->sinks, i);
+
+		if (s->thread) {
+			g_thread_join(s->thread);
+			s->thread = NULL;
+		}
+	}
+}
+
+/* Writes out the rest, waits for all the outputs and closes them.
+ * Returns EX_IOERR if writing any of them failed. */
+gint miragefanout_finish(miragefanout_t* const fo) {
+	gint ret = EX_OK;
+	guint i;
+
+	if (fo->current && fo->current->len)
+		miragefanout_dispatch(fo);
+	miragefanout_join(fo);
+
+	for (i = 0; i < fo->sinks->len; i++) {
+		miragefanout_sink_t* const s = g_ptr_array_index(fo->sinks, i);
+
+		if (s->fn ? fclose(s->f) : fflush(s->f)) {
+			if (!s->error)
+				s->error = errno;
+		}
+		s->f = NULL;
+
+		if (s->error) {
+			g_printerr("Writing to %s%s%s failed: %s\n", s->fn ? "'" : "",
+					s->fn ? s->fn : "standard output", s->fn ? "'" : "",
+					g_strerror(s->error));
+			ret = EX_IOERR;
+		}
+	}
+
+	return ret;
+}
+
+void miragefanout_free(miragefanout_t* const fo) {
+	guint i;
+
+	miragefanout_join(fo);
+
+	for (i = 0; i < fo->sinks->len; i++) {
+		miragefanout_sink_t* const s = g_ptr_array_index(fo->sinks, i);
+
+		if (s->fn && s->f && fclose(s->f))
+			g_printerr("fclose() failed: %s", g_strerror(errno));
+		g_async_queue_unref(s->queue);
+		g_free(s->fn);
+		g_free(s);
+	}
+	g_ptr_array_free(fo->sinks, TRUE);
+
+	if (fo->current)
+		g_async_queue_push(fo->idle, fo->current);
+	for (i = 0; i < MIRAGEFANOUT_BUFFERS; i++) {
+		miragefanout_buffer_t* const b = g_async_queue_pop(fo->idle);
+
+		g_free(b->data);
+		g_free(b);
+	}
+	g_async_queue_unref(fo->idle);
+	sigaction(SIGPIPE, &fo->sigpipe, NULL);
+	g_free(fo);
+}
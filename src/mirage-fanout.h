@@ -0,0 +1,21 @@
+/* mirage2iso; writing a single conversion into multiple outputs
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_FANOUT_H
+#define _MIRAGE_FANOUT_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef struct miragefanout miragefanout_t;
+
+miragefanout_t* miragefanout_new(void);
+void miragefanout_add(miragefanout_t* const fo, FILE* const f, const gchar* const fn);
+gboolean miragefanout_write(const guint8* const buf, const gsize len, gpointer user_data);
+gint miragefanout_finish(miragefanout_t* const fo);
+void miragefanout_free(miragefanout_t* const fo);
+
+#endif
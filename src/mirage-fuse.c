@@ -0,0 +1,123 @@
+/* mirage2iso; FUSE interface
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#define FUSE_USE_VERSION 26
+
+#include <glib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "mirage-cache.h"
+#include "mirage-fuse.h"
+#include "mirage-sysexits.h"
+
+extern gboolean quiet;
+extern gboolean verbose;
+
+static miragecache_t *miragefuse_cache = NULL;
+static gchar *miragefuse_path = NULL; /* '/' + name */
+static time_t miragefuse_time;
+
+static int miragefuse_getattr(const char* path, struct stat* st) {
+	memset(st, 0, sizeof(*st));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = st->st_ctime = miragefuse_time;
+
+	if (!strcmp(path, "/")) {
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+	} else if (!strcmp(path, miragefuse_path)) {
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = miragecache_get_size(miragefuse_cache);
+	} else
+		return -ENOENT;
+
+	return 0;
+}
+
+static int miragefuse_readdir(const char* path, void* buf, fuse_fill_dir_t filler,
+		off_t offset, struct fuse_file_info* fi) {
+	if (strcmp(path, "/"))
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	filler(buf, &miragefuse_path[1], NULL, 0);
+
+	return 0;
+}
+
+static int miragefuse_open(const char* path, struct fuse_file_info* fi) {
+	if (strcmp(path, miragefuse_path))
+		return -ENOENT;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	/* the image doesn't change under us */
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int miragefuse_read(const char* path, char* buf, size_t size, off_t offset,
+		struct fuse_file_info* fi) {
+	const guint64 fsize = miragecache_get_size(miragefuse_cache);
+
+	if ((guint64) offset >= fsize)
+		return 0;
+	if (offset + size > fsize)
+		size = fsize - offset;
+
+	if (!miragecache_read(miragefuse_cache, (guint8*) buf, size, offset))
+		return -EIO;
+
+	return size;
+}
+
+gint miragefuse_mount(const gchar* const mountpoint, const gchar* const name,
+		const gint track_num, const gsize cache_size) {
+	/* run in foreground (keeps libmirage state and read-ahead thread),
+	 * single-threaded (libmirage calls are serialized anyway) */
+	gchar *args[] = { "mirage2iso", "-f", "-s", "-o", "ro,fsname=mirage2iso,subtype=mirage2iso",
+		NULL, NULL };
+	struct fuse_operations ops;
+	gint ret;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.getattr = miragefuse_getattr;
+	ops.readdir = miragefuse_readdir;
+	ops.open = miragefuse_open;
+	ops.read = miragefuse_read;
+
+	if (!((miragefuse_cache = miragecache_new(track_num, cache_size))))
+		return EX_DATAERR;
+
+	miragefuse_path = g_strdup_printf("/%s", name);
+	miragefuse_time = time(NULL);
+	args[5] = (gchar*) mountpoint;
+
+	if (verbose)
+		g_printerr("Exposing track %d as '%s%s'\n", track_num, mountpoint, miragefuse_path);
+	if (!quiet)
+		g_printerr("Serving the image until unmounted (fusermount -u %s)\n", mountpoint);
+
+	ret = fuse_main(G_N_ELEMENTS(args) - 1, args, &ops, NULL) ? EX_OSERR : EX_OK;
+
+	g_free(miragefuse_path);
+	miragecache_free(miragefuse_cache);
+	return ret;
+}
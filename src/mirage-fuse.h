@@ -0,0 +1,14 @@
+/* mirage2iso; FUSE interface
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_FUSE_H
+#define _MIRAGE_FUSE_H 1
+
+#include <glib.h>
+
+gint miragefuse_mount(const gchar* const mountpoint, const gchar* const name,
+		const gint track_num, const gsize cache_size);
+
+#endif
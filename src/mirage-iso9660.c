@@ -0,0 +1,439 @@
+/* mirage2iso; ISO9660 filesystem reader
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mirage-cache.h"
+#include "mirage-iso9660.h"
+
+#define MIRAGEISO_SECTOR 2048
+#define MIRAGEISO_VD_START 16
+#define MIRAGEISO_VD_MAX 32
+#define MIRAGEISO_MAX_DEPTH 64
+#define MIRAGEISO_COPY_CHUNK (1 << 20)
+
+/* directory record flags */
+#define MIRAGEISO_FLAG_DIR 0x02
+#define MIRAGEISO_FLAG_MULTIEXTENT 0x80
+
+/* which names do we use, in order of preference */
+typedef enum {
+	plain,
+	joliet,
+	rockridge
+} mirageiso_names_t;
+
+typedef struct {
+	guint32 lba;
+	guint32 len;
+} mirageiso_extent_t;
+
+typedef struct {
+	gchar *name;
+	gboolean dir;
+	guint64 size;
+	GArray *extents;
+} mirageiso_entry_t;
+
+struct mirageiso {
+	miragecache_t *cache;
+	mirageiso_names_t names;
+	guint susp_skip;
+	mirageiso_entry_t *root;
+	GHashTable *dirs; /* first extent -> GPtrArray of entries */
+};
+
+static guint32 mirageiso_get32(const guint8* const p) {
+	/* both-endian fields, use the little endian half */
+	return p[0] | p[1] << 8 | p[2] << 16 | (guint32) p[3] << 24;
+}
+
+static guint8* mirageiso_read(mirageiso_t* const iso, const guint64 offset, const gsize len) {
+	guint8* const buf = g_malloc(len);
+
+	if (!miragecache_read(iso->cache, buf, len, offset)) {
+		g_free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+static void mirageiso_entry_free(gpointer data) {
+	mirageiso_entry_t* const ent = data;
+
+	g_free(ent->name);
+	g_array_free(ent->extents, TRUE);
+	g_free(ent);
+}
+
+/* Returns the System Use area of the record, or NULL if there's none. */
+static const guint8* mirageiso_get_su(mirageiso_t* const iso, const guint8* const rec, gsize* const len) {
+	const guint8 namelen = rec[32];
+	/* the name is padded to even length */
+	const gsize start = 33 + namelen + !(namelen % 2) + iso->susp_skip;
+
+	if (start + 4 > rec[0])
+		return NULL;
+
+	*len = rec[0] - start;
+	return &rec[start];
+}
+
+static gchar* mirageiso_rr_name(mirageiso_t* const iso, const guint8* su, gsize len) {
+	GString *name = NULL;
+	guint8 *cebuf = NULL;
+	guint64 ce_offset = 0;
+	guint32 ce_len = 0;
+	gint hops = 0;
+
+	for (;;) {
+		while (len >= 4) {
+			const guint8 entlen = su[2];
+
+			if (entlen < 4 || entlen > len)
+				break;
+
+			if (su[0] == 'N' && su[1] == 'M' && entlen >= 5) {
+				/* CURRENT and PARENT flags mean '.' and '..' */
+				if (!(su[4] & 0x06)) {
+					if (!name)
+						name = g_string_new(NULL);
+					g_string_append_len(name, (const gchar*) &su[5], entlen - 5);
+				}
+			} else if (su[0] == 'C' && su[1] == 'E' && entlen >= 28) {
+				ce_offset = (guint64) mirageiso_get32(&su[4]) * MIRAGEISO_SECTOR
+					+ mirageiso_get32(&su[12]);
+				ce_len = mirageiso_get32(&su[20]);
+			} else if (su[0] == 'S' && su[1] == 'T')
+				break;
+
+			su += entlen;
+			len -= entlen;
+		}
+
+		/* follow the continuation area, if any */
+		g_free(cebuf);
+		cebuf = NULL;
+		if (!ce_len || ce_len > MIRAGEISO_SECTOR || ++hops > 8)
+			break;
+		if (!((cebuf = mirageiso_read(iso, ce_offset, ce_len))))
+			break;
+		su = cebuf;
+		len = ce_len;
+		ce_len = 0;
+	}
+
+	g_free(cebuf);
+	return name ? g_string_free(name, FALSE) : NULL;
+}
+
+static gchar* mirageiso_name(mirageiso_t* const iso, const guint8* const rec) {
+	const guint8 namelen = rec[32];
+	const gchar* const raw = (const gchar*) &rec[33];
+	gchar *name = NULL, *p;
+
+	if (iso->names == rockridge) {
+		const guint8 *su;
+		gsize sulen;
+
+		if (((su = mirageiso_get_su(iso, rec, &sulen))))
+			name = mirageiso_rr_name(iso, su, sulen);
+		if (name)
+			return name;
+	}
+
+	if (iso->names == joliet)
+		name = g_convert(raw, namelen, "UTF-8", "UTF-16BE", NULL, NULL, NULL);
+	if (!name)
+		name = g_strndup(raw, namelen);
+
+	/* strip the version, and the dot of extension-less names */
+	if (((p = strrchr(name, ';'))))
+		*p = 0;
+	p = &name[strlen(name)];
+	if (p > name && p[-1] == '.')
+		p[-1] = 0;
+
+	return name;
+}
+
+static mirageiso_entry_t* mirageiso_entry_new(const guint8* const rec, gchar* const name) {
+	mirageiso_entry_t* const ent = g_new0(mirageiso_entry_t, 1);
+	mirageiso_extent_t ext;
+
+	ent->name = name;
+	ent->dir = rec[25] & MIRAGEISO_FLAG_DIR;
+	ent->extents = g_array_new(FALSE, FALSE, sizeof(mirageiso_extent_t));
+
+	ext.lba = mirageiso_get32(&rec[2]);
+	ext.len = mirageiso_get32(&rec[10]);
+	g_array_append_val(ent->extents, ext);
+	ent->size = ext.len;
+
+	return ent;
+}
+
+static GPtrArray* mirageiso_load_dir(mirageiso_t* const iso, const mirageiso_entry_t* const dir) {
+	const mirageiso_extent_t* const ext = &g_array_index(dir->extents, mirageiso_extent_t, 0);
+	GPtrArray *ents;
+	mirageiso_entry_t *last = NULL;
+	gboolean continued = FALSE;
+	guint8 *data;
+	guint32 pos;
+
+	if (((ents = g_hash_table_lookup(iso->dirs, GUINT_TO_POINTER(ext->lba)))))
+		return ents;
+
+	if (!((data = mirageiso_read(iso, (guint64) ext->lba * MIRAGEISO_SECTOR, ext->len)))) {
+		g_printerr("Unable to read directory at sector %u\n", ext->lba);
+		return NULL;
+	}
+
+	ents = g_ptr_array_new_with_free_func(mirageiso_entry_free);
+	for (pos = 0; pos < ext->len;) {
+		const guint8* const rec = &data[pos];
+
+		/* records don't cross sector boundaries, zero-padded instead */
+		if (rec[0] == 0) {
+			pos = (pos / MIRAGEISO_SECTOR + 1) * MIRAGEISO_SECTOR;
+			continue;
+		}
+		if (rec[0] < 34 || pos + rec[0] > ext->len || 33 + rec[32] > rec[0]) {
+			g_printerr("Malformed directory record at sector %u\n",
+					ext->lba + pos / MIRAGEISO_SECTOR);
+			break;
+		}
+
+		if (continued) {
+			/* next part of a multi-extent file */
+			mirageiso_extent_t more;
+
+			more.lba = mirageiso_get32(&rec[2]);
+			more.len = mirageiso_get32(&rec[10]);
+			g_array_append_val(last->extents, more);
+			last->size += more.len;
+		} else if (rec[32] != 1 || rec[33] > 1) { /* skip '.' and '..' */
+			last = mirageiso_entry_new(rec, mirageiso_name(iso, rec));
+			g_ptr_array_add(ents, last);
+		}
+
+		continued = last && (rec[25] & MIRAGEISO_FLAG_MULTIEXTENT);
+		pos += rec[0];
+	}
+
+	g_free(data);
+	g_hash_table_insert(iso->dirs, GUINT_TO_POINTER(ext->lba), ents);
+	return ents;
+}
+
+/* Checks for the SUSP 'SP' entry in root's '.' record. */
+static void mirageiso_detect_rockridge(mirageiso_t* const iso) {
+	const mirageiso_extent_t* const ext = &g_array_index(iso->root->extents, mirageiso_extent_t, 0);
+	guint8* const data = mirageiso_read(iso, (guint64) ext->lba * MIRAGEISO_SECTOR, MIRAGEISO_SECTOR);
+	const guint8 *su;
+	gsize sulen;
+
+	if (!data)
+		return;
+
+	if (data[0] >= 34
+			&& ((su = mirageiso_get_su(iso, data, &sulen)))
+			&& sulen >= 7 && su[0] == 'S' && su[1] == 'P' && su[4] == 0xbe && su[5] == 0xef) {
+		iso->names = rockridge;
+		iso->susp_skip = su[6];
+	}
+
+	g_free(data);
+}
+
+mirageiso_t* mirageiso_open(miragecache_t* const cache) {
+	mirageiso_t* const iso = g_new0(mirageiso_t, 1);
+	guint8 *pvd = NULL, *svd = NULL;
+	gint i;
+
+	iso->cache = cache;
+	iso->dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			(GDestroyNotify) g_ptr_array_unref);
+
+	for (i = MIRAGEISO_VD_START; i < MIRAGEISO_VD_START + MIRAGEISO_VD_MAX; i++) {
+		guint8* const vd = mirageiso_read(iso, (guint64) i * MIRAGEISO_SECTOR, MIRAGEISO_SECTOR);
+
+		if (!vd || memcmp(&vd[1], "CD001", 5) || vd[0] == 255) {
+			g_free(vd);
+			break;
+		}
+
+		if (vd[0] == 1 && !pvd)
+			pvd = vd;
+		/* Joliet SVD is identified by the UCS-2 escape sequence */
+		else if (vd[0] == 2 && !svd && vd[88] == '%' && vd[89] == '/'
+				&& (vd[90] == '@' || vd[90] == 'C' || vd[90] == 'E'))
+			svd = vd;
+		else
+			g_free(vd);
+	}
+
+	if (!pvd) {
+		g_printerr("No ISO9660 filesystem found in the track\n");
+		g_free(svd);
+		mirageiso_free(iso);
+		return NULL;
+	}
+
+	/* Rock Ridge names are the best, if they're there */
+	iso->root = mirageiso_entry_new(&pvd[156], g_strdup(""));
+	mirageiso_detect_rockridge(iso);
+
+	if (iso->names != rockridge && svd) {
+		mirageiso_entry_free(iso->root);
+		iso->root = mirageiso_entry_new(&svd[156], g_strdup(""));
+		iso->names = joliet;
+	}
+
+	g_free(pvd);
+	g_free(svd);
+	return iso;
+}
+
+static const mirageiso_entry_t* mirageiso_lookup(mirageiso_t* const iso, const gchar* const path) {
+	gchar** const comps = g_strsplit(path, "/", -1);
+	const mirageiso_entry_t *cur = iso->root;
+	gchar **c;
+
+	for (c = comps; cur && *c; c++) {
+		const mirageiso_entry_t *found = NULL;
+		GPtrArray *ents;
+		guint i;
+
+		if (!**c || !strcmp(*c, "."))
+			continue;
+
+		if (!cur->dir || !((ents = mirageiso_load_dir(iso, cur)))) {
+			cur = NULL;
+			break;
+		}
+
+		/* exact match first, then ISO9660-style case-insensitive one */
+		for (i = 0; !found && i < ents->len; i++) {
+			const mirageiso_entry_t* const ent = g_ptr_array_index(ents, i);
+			if (!strcmp(ent->name, *c))
+				found = ent;
+		}
+		for (i = 0; !found && i < ents->len; i++) {
+			const mirageiso_entry_t* const ent = g_ptr_array_index(ents, i);
+			if (!g_ascii_strcasecmp(ent->name, *c))
+				found = ent;
+		}
+
+		cur = found;
+	}
+
+	g_strfreev(comps);
+	if (!cur)
+		g_printerr("No such file or directory in the image: %s\n", path);
+	return cur;
+}
+
+gint64 mirageiso_stat(mirageiso_t* const iso, const gchar* const path) {
+	const mirageiso_entry_t* const ent = mirageiso_lookup(iso, path);
+
+	if (!ent)
+		return -1;
+	if (ent->dir) {
+		g_printerr("%s is a directory\n", path);
+		return -1;
+	}
+
+	return ent->size;
+}
+
+static gboolean mirageiso_list_dir(mirageiso_t* const iso, const mirageiso_entry_t* const dir,
+		const gchar* const prefix, const gint depth, FILE* const f) {
+	GPtrArray *ents;
+	guint i;
+
+	if (depth > MIRAGEISO_MAX_DEPTH) {
+		g_printerr("Directory tree too deep at %s\n", prefix);
+		return FALSE;
+	}
+	if (!((ents = mirageiso_load_dir(iso, dir))))
+		return FALSE;
+
+	for (i = 0; i < ents->len; i++) {
+		const mirageiso_entry_t* const ent = g_ptr_array_index(ents, i);
+		gchar* const path = g_strdup_printf("%s/%s", prefix, ent->name);
+		gboolean ret = TRUE;
+
+		if (ent->dir) {
+			fprintf(f, "%12s %s/\n", "-", path);
+			ret = mirageiso_list_dir(iso, ent, path, depth + 1, f);
+		} else
+			fprintf(f, "%12" G_GUINT64_FORMAT " %s\n", ent->size, path);
+
+		g_free(path);
+		if (!ret)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+gboolean mirageiso_list(mirageiso_t* const iso, FILE* const f) {
+	return mirageiso_list_dir(iso, iso->root, "", 0, f);
+}
+
+gboolean mirageiso_extract(mirageiso_t* const iso, const gchar* const path, FILE* const f) {
+	const mirageiso_entry_t* const ent = mirageiso_lookup(iso, path);
+	guint8 *buf;
+	guint i;
+
+	if (!ent)
+		return FALSE;
+
+	buf = g_malloc(MIRAGEISO_COPY_CHUNK);
+	for (i = 0; i < ent->extents->len; i++) {
+		const mirageiso_extent_t* const ext = &g_array_index(ent->extents, mirageiso_extent_t, i);
+		guint64 offset = (guint64) ext->lba * MIRAGEISO_SECTOR;
+		guint32 left = ext->len;
+
+		while (left > 0) {
+			const guint32 len = MIN(left, MIRAGEISO_COPY_CHUNK);
+
+			if (!miragecache_read(iso->cache, buf, len, offset)) {
+				g_printerr("Unable to read %s at offset %" G_GUINT64_FORMAT "\n", path, offset);
+				g_free(buf);
+				return FALSE;
+			}
+
+			if (fwrite(buf, len, 1, f) != 1) {
+				g_printerr("Write failed: %s\n", g_strerror(errno));
+				g_free(buf);
+				return FALSE;
+			}
+
+			offset += len;
+			left -= len;
+		}
+	}
+
+	g_free(buf);
+	return TRUE;
+}
+
+void mirageiso_free(mirageiso_t* const iso) {
+	if (iso->root)
+		mirageiso_entry_free(iso->root);
+	g_hash_table_destroy(iso->dirs);
+	g_free(iso);
+}
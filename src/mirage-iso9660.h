@@ -0,0 +1,23 @@
+/* mirage2iso; ISO9660 filesystem reader
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_ISO9660_H
+#define _MIRAGE_ISO9660_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "mirage-cache.h"
+
+typedef struct mirageiso mirageiso_t;
+
+mirageiso_t* mirageiso_open(miragecache_t* const cache);
+gint64 mirageiso_stat(mirageiso_t* const iso, const gchar* const path);
+gboolean mirageiso_list(mirageiso_t* const iso, FILE* const f);
+gboolean mirageiso_extract(mirageiso_t* const iso, const gchar* const path, FILE* const f);
+void mirageiso_free(mirageiso_t* const iso);
+
+#endif
@@ -0,0 +1,708 @@
+/* mirage2iso; NBD server
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#include "mirage-cache.h"
+#include "mirage-nbd.h"
+#include "mirage-server.h"
+#include "mirage-sysexits.h"
+
+extern gboolean quiet;
+extern gboolean verbose;
+
+/* Protocol constants, see doc/proto.md in the NBD tree. We implement
+ * the fixed newstyle handshake only, with structured replies and
+ * the base:allocation metadata context. */
+#define NBD_MAGIC G_GUINT64_CONSTANT(0x4e42444d41474943)
+#define NBD_IHAVEOPT G_GUINT64_CONSTANT(0x49484156454f5054)
+#define NBD_REP_MAGIC G_GUINT64_CONSTANT(0x0003e889045565a9)
+#define NBD_REQUEST_MAGIC 0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS (1 << 0)
+#define NBD_FLAG_READ_ONLY (1 << 1)
+#define NBD_FLAG_CAN_MULTI_CONN (1 << 8)
+#define NBD_FLAG_SEND_CACHE (1 << 10)
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT 2
+#define NBD_OPT_LIST 3
+#define NBD_OPT_INFO 6
+#define NBD_OPT_GO 7
+#define NBD_OPT_STRUCTURED_REPLY 8
+#define NBD_OPT_LIST_META_CONTEXT 9
+#define NBD_OPT_SET_META_CONTEXT 10
+
+#define NBD_REP_ACK 1
+#define NBD_REP_SERVER 2
+#define NBD_REP_INFO 3
+#define NBD_REP_META_CONTEXT 4
+#define NBD_REP_ERR_UNSUP 0x80000001
+#define NBD_REP_ERR_INVALID 0x80000003
+#define NBD_REP_ERR_UNKNOWN 0x80000006
+
+#define NBD_INFO_EXPORT 0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_CMD_READ 0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC 2
+#define NBD_CMD_CACHE 5
+#define NBD_CMD_BLOCK_STATUS 7
+#define NBD_CMD_FLAG_REQ_ONE (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE (1 << 0)
+#define NBD_REPLY_TYPE_NONE 0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_OFFSET_HOLE 2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR 32769
+
+#define NBD_STATE_HOLE (1 << 0)
+#define NBD_STATE_ZERO (1 << 1)
+
+#define NBD_EPERM 1
+#define NBD_EIO 5
+#define NBD_EINVAL 22
+
+#define NBD_META_ALLOCATION "base:allocation"
+#define NBD_META_ALLOCATION_ID 1
+
+/* largest read we serve, and the largest range block status scans */
+#define MIRAGENBD_MAX_REQUEST (32 << 20)
+#define MIRAGENBD_MAX_OPTION 4096
+
+typedef struct {
+	int fd;
+	gboolean structured;
+	gboolean meta_allocation;
+	GThread *thread;
+	/* set when the thread is done and can be joined */
+	gint done;
+} miragenbd_conn_t;
+
+static miragecache_t *miragenbd_cache = NULL;
+static gchar *miragenbd_name = NULL;
+static volatile sig_atomic_t miragenbd_terminate = 0;
+
+static void miragenbd_sighandler(int sig) {
+	miragenbd_terminate = 1;
+}
+
+static void miragenbd_put16(guint8* const p, const guint16 v) {
+	const guint16 be = GUINT16_TO_BE(v);
+	memcpy(p, &be, sizeof(be));
+}
+
+static void miragenbd_put32(guint8* const p, const guint32 v) {
+	const guint32 be = GUINT32_TO_BE(v);
+	memcpy(p, &be, sizeof(be));
+}
+
+static void miragenbd_put64(guint8* const p, const guint64 v) {
+	const guint64 be = GUINT64_TO_BE(v);
+	memcpy(p, &be, sizeof(be));
+}
+
+static guint16 miragenbd_get16(const guint8* const p) {
+	guint16 be;
+	memcpy(&be, p, sizeof(be));
+	return GUINT16_FROM_BE(be);
+}
+
+static guint32 miragenbd_get32(const guint8* const p) {
+	guint32 be;
+	memcpy(&be, p, sizeof(be));
+	return GUINT32_FROM_BE(be);
+}
+
+static guint64 miragenbd_get64(const guint8* const p) {
+	guint64 be;
+	memcpy(&be, p, sizeof(be));
+	return GUINT64_FROM_BE(be);
+}
+
+static gboolean miragenbd_recv(const int fd, gpointer buf, gsize len) {
+	guint8 *p = buf;
+
+	while (len > 0) {
+		const gssize rd = read(fd, p, len);
+
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			return FALSE;
+
+		p += rd;
+		len -= rd;
+	}
+
+	return TRUE;
+}
+
+static gboolean miragenbd_send(const int fd, gconstpointer buf, gsize len) {
+	const guint8 *p = buf;
+
+	while (len > 0) {
+		const gssize wr = write(fd, p, len);
+
+		if (wr == -1 && errno == EINTR)
+			continue;
+		if (wr <= 0)
+			return FALSE;
+
+		p += wr;
+		len -= wr;
+	}
+
+	return TRUE;
+}
+
+static gboolean miragenbd_opt_reply(const int fd, const guint32 opt, const guint32 type,
+		gconstpointer data, const guint32 len) {
+	guint8 hdr[20];
+
+	miragenbd_put64(&hdr[0], NBD_REP_MAGIC);
+	miragenbd_put32(&hdr[8], opt);
+	miragenbd_put32(&hdr[12], type);
+	miragenbd_put32(&hdr[16], len);
+
+	return miragenbd_send(fd, hdr, sizeof(hdr)) && miragenbd_send(fd, data, len);
+}
+
+static gboolean miragenbd_name_matches(const gchar* const name, const guint32 len) {
+	/* the default export is the only one */
+	return len == 0 || (len == strlen(miragenbd_name) && !memcmp(name, miragenbd_name, len));
+}
+
+static gboolean miragenbd_send_info(const int fd, const guint32 opt) {
+	guint8 export[12], bsize[14];
+
+	miragenbd_put16(&export[0], NBD_INFO_EXPORT);
+	miragenbd_put64(&export[2], miragecache_get_size(miragenbd_cache));
+	miragenbd_put16(&export[10], NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY
+			| NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_SEND_CACHE);
+
+	miragenbd_put16(&bsize[0], NBD_INFO_BLOCK_SIZE);
+	miragenbd_put32(&bsize[2], 1);
+	miragenbd_put32(&bsize[6], 2048);
+	miragenbd_put32(&bsize[10], MIRAGENBD_MAX_REQUEST);
+
+	return miragenbd_opt_reply(fd, opt, NBD_REP_INFO, export, sizeof(export))
+		&& miragenbd_opt_reply(fd, opt, NBD_REP_INFO, bsize, sizeof(bsize))
+		&& miragenbd_opt_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/* Handles NBD_OPT_{LIST,SET}_META_CONTEXT. */
+static gboolean miragenbd_meta_context(miragenbd_conn_t* const conn, const guint32 opt,
+		const guint8* const data, const guint32 len) {
+	guint8 reply[4 + sizeof(NBD_META_ALLOCATION) - 1];
+	guint32 pos, namelen, queries, i;
+	gboolean match = FALSE;
+
+	if (len < 8 || ((namelen = miragenbd_get32(data))) > len - 8
+			|| (opt == NBD_OPT_SET_META_CONTEXT && !conn->structured))
+		return miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_INVALID, NULL, 0);
+	if (!miragenbd_name_matches((const gchar*) &data[4], namelen))
+		return miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+	pos = 4 + namelen;
+	queries = miragenbd_get32(&data[pos]);
+	pos += 4;
+
+	/* listing with no queries lists everything */
+	if (queries == 0 && opt == NBD_OPT_LIST_META_CONTEXT)
+		match = TRUE;
+
+	for (i = 0; i < queries; i++) {
+		guint32 qlen;
+
+		if (pos + 4 > len || ((qlen = miragenbd_get32(&data[pos]))) > len - pos - 4)
+			return miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_INVALID, NULL, 0);
+		pos += 4;
+
+		if ((qlen == strlen(NBD_META_ALLOCATION) && !memcmp(&data[pos], NBD_META_ALLOCATION, qlen))
+				|| (opt == NBD_OPT_LIST_META_CONTEXT && qlen == 5 && !memcmp(&data[pos], "base:", qlen)))
+			match = TRUE;
+		pos += qlen;
+	}
+
+	if (opt == NBD_OPT_SET_META_CONTEXT)
+		conn->meta_allocation = match;
+
+	if (match) {
+		miragenbd_put32(reply, NBD_META_ALLOCATION_ID);
+		memcpy(&reply[4], NBD_META_ALLOCATION, sizeof(reply) - 4);
+		if (!miragenbd_opt_reply(conn->fd, opt, NBD_REP_META_CONTEXT, reply, sizeof(reply)))
+			return FALSE;
+	}
+
+	return miragenbd_opt_reply(conn->fd, opt, NBD_REP_ACK, NULL, 0);
+}
+
+/* Returns TRUE when the client entered the transmission phase. */
+static gboolean miragenbd_handshake(miragenbd_conn_t* const conn) {
+	guint8 buf[18];
+	gboolean no_zeroes;
+	guint32 cflags;
+
+	miragenbd_put64(&buf[0], NBD_MAGIC);
+	miragenbd_put64(&buf[8], NBD_IHAVEOPT);
+	miragenbd_put16(&buf[16], NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (!miragenbd_send(conn->fd, buf, 18) || !miragenbd_recv(conn->fd, buf, 4))
+		return FALSE;
+
+	cflags = miragenbd_get32(buf);
+	if (!(cflags & NBD_FLAG_FIXED_NEWSTYLE)) {
+		if (verbose)
+			g_printerr("NBD client does not support fixed newstyle negotiation\n");
+		return FALSE;
+	}
+	no_zeroes = cflags & NBD_FLAG_NO_ZEROES;
+
+	for (;;) {
+		guint8 *data = NULL;
+		guint32 opt, len;
+		gboolean ret;
+
+		if (!miragenbd_recv(conn->fd, buf, 16) || miragenbd_get64(buf) != NBD_IHAVEOPT)
+			return FALSE;
+		opt = miragenbd_get32(&buf[8]);
+		len = miragenbd_get32(&buf[12]);
+
+		if (len > MIRAGENBD_MAX_OPTION)
+			return FALSE;
+		data = g_malloc(len + 1);
+		if (!miragenbd_recv(conn->fd, data, len)) {
+			g_free(data);
+			return FALSE;
+		}
+
+		switch (opt) {
+			case NBD_OPT_EXPORT_NAME: {
+				guint8 reply[10 + 124];
+
+				g_free(data);
+				memset(reply, 0, sizeof(reply));
+				miragenbd_put64(&reply[0], miragecache_get_size(miragenbd_cache));
+				miragenbd_put16(&reply[8], NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY
+						| NBD_FLAG_CAN_MULTI_CONN | NBD_FLAG_SEND_CACHE);
+				return miragenbd_send(conn->fd, reply, no_zeroes ? 10 : sizeof(reply));
+			}
+			case NBD_OPT_ABORT:
+				g_free(data);
+				miragenbd_opt_reply(conn->fd, opt, NBD_REP_ACK, NULL, 0);
+				return FALSE;
+			case NBD_OPT_LIST: {
+				const guint32 namelen = strlen(miragenbd_name);
+				guint8* const reply = g_malloc(4 + namelen);
+
+				miragenbd_put32(reply, namelen);
+				memcpy(&reply[4], miragenbd_name, namelen);
+				ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_SERVER, reply, 4 + namelen)
+					&& miragenbd_opt_reply(conn->fd, opt, NBD_REP_ACK, NULL, 0);
+				g_free(reply);
+				break;
+			}
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO: {
+				guint32 namelen;
+
+				if (len < 6 || ((namelen = miragenbd_get32(data))) > len - 6)
+					ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_INVALID, NULL, 0);
+				else if (!miragenbd_name_matches((const gchar*) &data[4], namelen))
+					ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_UNKNOWN, NULL, 0);
+				else {
+					/* we send the block size info regardless of the requests */
+					ret = miragenbd_send_info(conn->fd, opt);
+					if (ret && opt == NBD_OPT_GO) {
+						g_free(data);
+						return TRUE;
+					}
+				}
+				break;
+			}
+			case NBD_OPT_STRUCTURED_REPLY:
+				if (len) {
+					ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_INVALID, NULL, 0);
+					break;
+				}
+				conn->structured = TRUE;
+				ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_ACK, NULL, 0);
+				break;
+			case NBD_OPT_LIST_META_CONTEXT:
+			case NBD_OPT_SET_META_CONTEXT:
+				ret = miragenbd_meta_context(conn, opt, data, len);
+				break;
+			default:
+				ret = miragenbd_opt_reply(conn->fd, opt, NBD_REP_ERR_UNSUP, NULL, 0);
+		}
+
+		g_free(data);
+		if (!ret)
+			return FALSE;
+	}
+}
+
+static gboolean miragenbd_simple_reply(const int fd, const guint64 cookie, const guint32 error,
+		gconstpointer data, const gsize len) {
+	guint8 hdr[16];
+
+	miragenbd_put32(&hdr[0], NBD_SIMPLE_REPLY_MAGIC);
+	miragenbd_put32(&hdr[4], error);
+	miragenbd_put64(&hdr[8], cookie);
+
+	return miragenbd_send(fd, hdr, sizeof(hdr)) && miragenbd_send(fd, data, len);
+}
+
+static gboolean miragenbd_chunk(const int fd, const guint64 cookie, const guint16 flags,
+		const guint16 type, gconstpointer prefix, const guint32 prefix_len,
+		gconstpointer data, const guint32 len) {
+	guint8 hdr[20];
+
+	miragenbd_put32(&hdr[0], NBD_STRUCTURED_REPLY_MAGIC);
+	miragenbd_put16(&hdr[4], flags);
+	miragenbd_put16(&hdr[6], type);
+	miragenbd_put64(&hdr[8], cookie);
+	miragenbd_put32(&hdr[16], prefix_len + len);
+
+	return miragenbd_send(fd, hdr, sizeof(hdr))
+		&& miragenbd_send(fd, prefix, prefix_len)
+		&& miragenbd_send(fd, data, len);
+}
+
+static gboolean miragenbd_error(miragenbd_conn_t* const conn, const guint64 cookie,
+		const guint32 error) {
+	guint8 payload[6];
+
+	if (!conn->structured)
+		return miragenbd_simple_reply(conn->fd, cookie, error, NULL, 0);
+
+	miragenbd_put32(&payload[0], error);
+	miragenbd_put16(&payload[4], 0);
+	return miragenbd_chunk(conn->fd, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR,
+			payload, sizeof(payload), NULL, 0);
+}
+
+static gboolean miragenbd_read(miragenbd_conn_t* const conn, const guint64 cookie,
+		const guint64 offset, const guint32 len) {
+	guint8 *buf;
+	guint64 pos;
+	gboolean ret = TRUE;
+
+	if (!conn->structured) {
+		buf = g_malloc(len);
+		if (miragecache_read(miragenbd_cache, buf, len, offset))
+			ret = miragenbd_simple_reply(conn->fd, cookie, 0, buf, len);
+		else
+			ret = miragenbd_error(conn, cookie, NBD_EIO);
+		g_free(buf);
+		return ret;
+	}
+
+	/* zero runs go as holes, the rest as data chunks */
+	for (pos = offset; ret && pos < offset + len;) {
+		guint64 run;
+		gboolean zero;
+		guint8 prefix[12];
+		guint16 flags;
+
+		if (!miragecache_get_zero_run(miragenbd_cache, pos, offset + len - pos, &run, &zero))
+			return miragenbd_error(conn, cookie, NBD_EIO);
+
+		flags = pos + run == offset + len ? NBD_REPLY_FLAG_DONE : 0;
+		miragenbd_put64(prefix, pos);
+
+		if (zero) {
+			miragenbd_put32(&prefix[8], run);
+			ret = miragenbd_chunk(conn->fd, cookie, flags, NBD_REPLY_TYPE_OFFSET_HOLE,
+					prefix, 12, NULL, 0);
+		} else {
+			buf = g_malloc(run);
+			if (!miragecache_read(miragenbd_cache, buf, run, pos)) {
+				g_free(buf);
+				return miragenbd_error(conn, cookie, NBD_EIO);
+			}
+			ret = miragenbd_chunk(conn->fd, cookie, flags, NBD_REPLY_TYPE_OFFSET_DATA,
+					prefix, 8, buf, run);
+			g_free(buf);
+		}
+
+		pos += run;
+	}
+
+	return ret;
+}
+
+static gboolean miragenbd_block_status(miragenbd_conn_t* const conn, const guint64 cookie,
+		const guint16 cmdflags, const guint64 offset, const guint32 len) {
+	GByteArray* const payload = g_byte_array_new();
+	guint64 pos;
+	gboolean ret;
+	guint8 desc[8];
+
+	if (!conn->structured || !conn->meta_allocation) {
+		g_byte_array_free(payload, TRUE);
+		return miragenbd_error(conn, cookie, NBD_EINVAL);
+	}
+
+	miragenbd_put32(desc, NBD_META_ALLOCATION_ID);
+	g_byte_array_append(payload, desc, 4);
+
+	/* we need to decode the blocks to know, so reply for a limited range */
+	for (pos = offset; pos < offset + MIN(len, MIRAGENBD_MAX_REQUEST);) {
+		guint64 run;
+		gboolean zero;
+
+		if (!miragecache_get_zero_run(miragenbd_cache, pos,
+					offset + MIN(len, MIRAGENBD_MAX_REQUEST) - pos, &run, &zero)) {
+			g_byte_array_free(payload, TRUE);
+			return miragenbd_error(conn, cookie, NBD_EIO);
+		}
+
+		miragenbd_put32(&desc[0], run);
+		miragenbd_put32(&desc[4], zero ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0);
+		g_byte_array_append(payload, desc, 8);
+
+		pos += run;
+		if (cmdflags & NBD_CMD_FLAG_REQ_ONE)
+			break;
+	}
+
+	ret = miragenbd_chunk(conn->fd, cookie, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+			NULL, 0, payload->data, payload->len);
+	g_byte_array_free(payload, TRUE);
+	return ret;
+}
+
+static gpointer miragenbd_conn_thread(gpointer data) {
+	miragenbd_conn_t* const conn = data;
+	const guint64 size = miragecache_get_size(miragenbd_cache);
+
+	if (!miragenbd_handshake(conn)) {
+		g_atomic_int_set(&conn->done, TRUE);
+		return NULL;
+	}
+
+	if (verbose)
+		g_printerr("NBD client %d connected%s\n", conn->fd,
+				conn->structured ? " (structured replies)" : "");
+
+	for (;;) {
+		guint8 req[28];
+		guint16 cmdflags, type;
+		guint64 cookie, offset;
+		guint32 len;
+		gboolean ret;
+
+		if (!miragenbd_recv(conn->fd, req, sizeof(req))
+				|| miragenbd_get32(req) != NBD_REQUEST_MAGIC)
+			break;
+
+		cmdflags = miragenbd_get16(&req[4]);
+		type = miragenbd_get16(&req[6]);
+		cookie = miragenbd_get64(&req[8]);
+		offset = miragenbd_get64(&req[16]);
+		len = miragenbd_get32(&req[24]);
+
+		if (type == NBD_CMD_DISC)
+			break;
+
+		switch (type) {
+			case NBD_CMD_READ:
+			case NBD_CMD_CACHE:
+			case NBD_CMD_BLOCK_STATUS:
+				if (len == 0 || offset > size || len > size - offset
+						|| (type != NBD_CMD_BLOCK_STATUS && len > MIRAGENBD_MAX_REQUEST))
+					ret = miragenbd_error(conn, cookie, NBD_EINVAL);
+				else if (type == NBD_CMD_READ)
+					ret = miragenbd_read(conn, cookie, offset, len);
+				else if (type == NBD_CMD_BLOCK_STATUS)
+					ret = miragenbd_block_status(conn, cookie, cmdflags, offset, len);
+				else {
+					/* decode into the cache and discard */
+					guint8* const buf = g_malloc(len);
+
+					if (miragecache_read(miragenbd_cache, buf, len, offset))
+						ret = conn->structured
+							? miragenbd_chunk(conn->fd, cookie, NBD_REPLY_FLAG_DONE,
+									NBD_REPLY_TYPE_NONE, NULL, 0, NULL, 0)
+							: miragenbd_simple_reply(conn->fd, cookie, 0, NULL, 0);
+					else
+						ret = miragenbd_error(conn, cookie, NBD_EIO);
+					g_free(buf);
+				}
+				break;
+			case NBD_CMD_WRITE: {
+				/* the export is read-only, just skip the payload */
+				guint8* const buf = len <= MIRAGENBD_MAX_REQUEST ? g_malloc(len) : NULL;
+
+				ret = buf && miragenbd_recv(conn->fd, buf, len)
+					&& miragenbd_error(conn, cookie, NBD_EPERM);
+				g_free(buf);
+				break;
+			}
+			default:
+				ret = miragenbd_error(conn, cookie, NBD_EPERM);
+		}
+
+		if (!ret)
+			break;
+	}
+
+	if (verbose)
+		g_printerr("NBD client %d disconnected\n", conn->fd);
+	g_atomic_int_set(&conn->done, TRUE);
+	return NULL;
+}
+
+/* Joins the connection threads that are done, or all of them if all is set;
+ * their sockets are shut down first so that they stop waiting for requests. */
+static GSList* miragenbd_reap(GSList* conns, const gboolean all) {
+	GSList **prev = &conns;
+
+	while (*prev) {
+		miragenbd_conn_t* const conn = (*prev)->data;
+
+		if (!all && !g_atomic_int_get(&conn->done)) {
+			prev = &(*prev)->next;
+			continue;
+		}
+
+		if (all)
+			shutdown(conn->fd, SHUT_RDWR);
+		g_thread_join(conn->thread);
+		close(conn->fd);
+		g_free(conn);
+		*prev = g_slist_delete_link(*prev, *prev);
+	}
+
+	return conns;
+}
+
+/* Strips the unix: or tcp: prefix of the address. Without one, a port
+ * number or host:port is TCP, and anything else is a socket path. */
+static const gchar* miragenbd_parse_addr(const gchar* const addr, gboolean* const is_unix) {
+	const gchar *port;
+
+	if (g_str_has_prefix(addr, "unix:")) {
+		*is_unix = TRUE;
+		return addr + 5;
+	} else if (g_str_has_prefix(addr, "tcp:")) {
+		*is_unix = FALSE;
+		return addr + 4;
+	}
+
+	port = strrchr(addr, ':');
+	port = port ? port + 1 : addr;
+	*is_unix = !*port || strchr(addr, '/') || port[strspn(port, "0123456789")];
+	return addr;
+}
+
+gint miragenbd_serve(const gchar* const spec, const gchar* const name,
+		const gint track_num, const gsize cache_size) {
+	gboolean is_unix;
+	const gchar* const addr = miragenbd_parse_addr(spec, &is_unix);
+	const int sigs[] = { SIGINT, SIGTERM };
+	sigset_t blocked, orig;
+	struct sigaction sa;
+	GSList *conns = NULL;
+	gsize i;
+	int lfd;
+
+	/* block the signals before any thread is spawned, we get them in pselect() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = miragenbd_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigemptyset(&blocked);
+	for (i = 0; i < G_N_ELEMENTS(sigs); i++) {
+		sigaddset(&blocked, sigs[i]);
+		sigaction(sigs[i], &sa, NULL);
+	}
+	sigprocmask(SIG_BLOCK, &blocked, &orig);
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = is_unix ? miragesrv_listen_unix(addr) : miragesrv_listen_tcp(addr);
+	if (lfd == -1) {
+		sigprocmask(SIG_SETMASK, &orig, NULL);
+		return EX_OSERR;
+	}
+
+	if (!((miragenbd_cache = miragecache_new(track_num, cache_size)))) {
+		close(lfd);
+		sigprocmask(SIG_SETMASK, &orig, NULL);
+		return EX_DATAERR;
+	}
+	miragenbd_name = g_strdup(name);
+
+	if (!quiet)
+		g_printerr("Serving '%s' over NBD on '%s'\n", name, addr);
+
+	while (!miragenbd_terminate) {
+		miragenbd_conn_t *conn;
+		fd_set rfds;
+		int cfd;
+
+		FD_ZERO(&rfds);
+		FD_SET(lfd, &rfds);
+		conns = miragenbd_reap(conns, FALSE);
+		if (pselect(lfd + 1, &rfds, NULL, NULL, NULL, &orig) == -1) {
+			if (errno == EINTR)
+				continue;
+			g_printerr("pselect() failed: %s\n", g_strerror(errno));
+			break;
+		}
+
+		if ((cfd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				g_printerr("accept() failed: %s\n", g_strerror(errno));
+			continue;
+		}
+
+		if (!is_unix) {
+			const int one = 1;
+			setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+
+		conn = g_new0(miragenbd_conn_t, 1);
+		conn->fd = cfd;
+		conn->thread = g_thread_new("nbd", miragenbd_conn_thread, conn);
+		conns = g_slist_prepend(conns, conn);
+	}
+
+	close(lfd);
+	if (is_unix && unlink(addr))
+		g_printerr("unlink() failed: %s\n", g_strerror(errno));
+
+	/* the session is freed after we return, so nothing may be decoding then */
+	miragenbd_reap(conns, TRUE);
+	miragecache_free(miragenbd_cache);
+	miragenbd_cache = NULL;
+	g_free(miragenbd_name);
+	miragenbd_name = NULL;
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+
+	return EX_OK;
+}
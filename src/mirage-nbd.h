@@ -0,0 +1,14 @@
+/* mirage2iso; NBD server
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_NBD_H
+#define _MIRAGE_NBD_H 1
+
+#include <glib.h>
+
+gint miragenbd_serve(const gchar* const addr, const gchar* const name,
+		const gint track_num, const gsize cache_size);
+
+#endif
@@ -43,6 +43,7 @@ typedef enum mirage_tristate {
 } mirage_tristate_t;
 
 static gchar *mirage_current_password = NULL;
+static gboolean mirage_password_interactive = TRUE;
 
 void mirage_forget_password(void) {
 	if (mirage_current_password) {
@@ -58,6 +59,10 @@ void mirage_set_password(gchar* const pass) {
 	mirage_current_password = pass;
 }
 
+void mirage_disable_password_input(void) {
+	mirage_password_interactive = FALSE;
+}
+
 #ifdef HAVE_LIBASSUAN
 
 /* XXX: more portable solution? */
@@ -270,6 +275,12 @@ const gchar* mirage_input_password(void) {
 	if (mirage_current_password) /* password already there */
 		return mirage_current_password;
 
+	/* no terminal to ask on (e.g. in --serve job) */
+	if (!mirage_password_interactive) {
+		g_printerr("No password supplied\n");
+		return NULL;
+	}
+
 #ifdef HAVE_LIBASSUAN
 	switch (mirage_input_password_pinentry()) {
 		case error: break;
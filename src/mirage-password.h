@@ -11,5 +11,6 @@
 const gchar* mirage_input_password(void);
 void mirage_forget_password(void);
 void mirage_set_password(gchar* const pass);
+void mirage_disable_password_input(void);
 
 #endif
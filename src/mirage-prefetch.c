@@ -0,0 +1,304 @@
+/* mirage2iso; input read-ahead for conversion
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mirage-prefetch.h"
+
+extern gboolean verbose;
+
+/* used for reading ahead where posix_fadvise() can't be */
+#define MIRAGEPREFETCH_READ_SIZE (1 << 20)
+
+typedef struct {
+	gchar *fn;
+	gint fd;
+	guint64 size;
+} mirageprefetch_file_t;
+
+/* A run of sectors stored in a single file, or in a group of parts of
+ * a compressed image. The latter are mapped proportionally, as a run of
+ * compressed data is about as far in the files as it is in the track. */
+typedef struct {
+	gint address, length;
+	guint first_file, files;
+	/* offset of the first sector and sector size, 0 if compressed */
+	guint64 offset;
+	gint sector_size;
+	/* total size of files, if compressed */
+	guint64 physical;
+} mirageprefetch_extent_t;
+
+struct mirageprefetch {
+	GArray *files;
+	GArray *extents;
+	gint distance, step;
+	gint end;
+
+	/* protects everything below */
+	GMutex lock;
+	GCond cond;
+	gint target;
+	gboolean stop;
+	GThread *thread;
+	gint done;
+
+#ifndef POSIX_FADV_WILLNEED
+	guint8 *scratch;
+#endif
+};
+
+mirageprefetch_t* mirageprefetch_new(const gint distance) {
+	mirageprefetch_t* const pf = g_new0(mirageprefetch_t, 1);
+
+	pf->files = g_array_new(FALSE, FALSE, sizeof(mirageprefetch_file_t));
+	pf->extents = g_array_new(FALSE, FALSE, sizeof(mirageprefetch_extent_t));
+	pf->distance = distance;
+	/* don't wake up for every batch read */
+	pf->step = MAX(distance / 4, 1);
+	g_mutex_init(&pf->lock);
+	g_cond_init(&pf->cond);
+
+	return pf;
+}
+
+/* Returns the name of the next part of a split image: image.part01.daa
+ * -> image.part02.daa, image.daa -> image.d00 -> image.d01, or NULL. */
+static gchar* mirageprefetch_next_part(const gchar* const fn) {
+	const gchar *ext = strrchr(fn, '.');
+	const gchar *digits;
+	gchar *next;
+	gint i;
+
+	if (!ext)
+		return NULL;
+
+	if (!g_ascii_strcasecmp(ext, ".daa")) {
+		for (digits = ext; digits > fn && g_ascii_isdigit(digits[-1]); digits--);
+		if (digits == ext || digits - fn < 4 || g_ascii_strncasecmp(digits - 4, "part", 4))
+			return g_strdup_printf("%.*s.d00", (gint) (ext - fn), fn);
+	} else if (g_ascii_tolower(ext[1]) == 'd' && g_ascii_isdigit(ext[2])
+			&& g_ascii_isdigit(ext[3]) && !ext[4]) {
+		digits = &ext[2];
+		ext += 4;
+	} else
+		return NULL;
+
+	/* increment the number keeping its width */
+	next = g_strdup(fn);
+	for (i = ext - fn - 1; i >= digits - fn; i--) {
+		if (next[i] != '9') {
+			next[i]++;
+			return next;
+		}
+		next[i] = '0';
+	}
+
+	g_free(next);
+	return NULL;
+}
+
+static gint mirageprefetch_open(mirageprefetch_t* const pf, const gchar* const fn) {
+	mirageprefetch_file_t file;
+	struct stat st;
+	guint i;
+
+	for (i = 0; i < pf->files->len; i++) {
+		if (!strcmp(g_array_index(pf->files, mirageprefetch_file_t, i).fn, fn))
+			return i;
+	}
+
+	if (((file.fd = open(fn, O_RDONLY))) == -1)
+		return -1;
+	if (fstat(file.fd, &st)) {
+		close(file.fd);
+		return -1;
+	}
+
+	file.fn = g_strdup(fn);
+	file.size = st.st_size;
+	g_array_append_val(pf->files, file);
+	return pf->files->len - 1;
+}
+
+/* Adds a run of sectors, as libmirage describes it: stored in fn,
+ * starting at offset, sector_size bytes each (or less, if compressed). */
+gboolean mirageprefetch_add(mirageprefetch_t* const pf, const gint address, const gint length,
+		const gchar* const fn, const guint64 offset, const gint sector_size) {
+	mirageprefetch_extent_t e;
+	const gint file = mirageprefetch_open(pf, fn);
+	const mirageprefetch_file_t *f;
+
+	if (file == -1 || length <= 0)
+		return FALSE;
+
+	f = &g_array_index(pf->files, mirageprefetch_file_t, file);
+	e.address = address;
+	e.length = length;
+	e.first_file = file;
+	e.files = 1;
+	e.offset = offset;
+	e.sector_size = sector_size;
+	e.physical = f->size;
+
+	/* data doesn't fit in the file, so it has to be compressed */
+	if (offset + (guint64) length * sector_size > f->size) {
+		gchar *next = mirageprefetch_next_part(fn);
+
+		e.sector_size = 0;
+		while (next && g_file_test(next, G_FILE_TEST_IS_REGULAR)) {
+			const gint part = mirageprefetch_open(pf, next);
+			gchar* const name = next;
+
+			if (part != (gint) (e.first_file + e.files))
+				break;
+
+			e.physical += g_array_index(pf->files, mirageprefetch_file_t, part).size;
+			e.files++;
+			next = mirageprefetch_next_part(name);
+			g_free(name);
+		}
+		g_free(next);
+	}
+
+	g_array_append_val(pf->extents, e);
+	pf->end = MAX(pf->end, address + length);
+	return TRUE;
+}
+
+static void mirageprefetch_advise(mirageprefetch_t* const pf, const mirageprefetch_file_t* const f,
+		const guint64 offset, const guint64 len) {
+#ifdef POSIX_FADV_WILLNEED
+	if ((errno = posix_fadvise(f->fd, offset, len, POSIX_FADV_WILLNEED)) && verbose)
+		g_printerr("posix_fadvise() failed: %s\n", g_strerror(errno));
+#else
+	guint64 pos;
+
+	for (pos = 0; pos < len; pos += MIRAGEPREFETCH_READ_SIZE) {
+		if (pread(f->fd, pf->scratch, MIN(len - pos, MIRAGEPREFETCH_READ_SIZE), offset + pos) <= 0)
+			break;
+	}
+#endif
+}
+
+/* Reads ahead the input for sectors [from, to). */
+static void mirageprefetch_issue(mirageprefetch_t* const pf, const gint from, const gint to) {
+	guint i, j;
+
+	for (i = 0; i < pf->extents->len; i++) {
+		const mirageprefetch_extent_t* const e = &g_array_index(pf->extents, mirageprefetch_extent_t, i);
+		const gint a = MAX(from, e->address) - e->address;
+		const gint b = MIN(to, e->address + e->length) - e->address;
+		guint64 p0, p1;
+
+		if (a >= b)
+			continue;
+
+		if (e->sector_size) {
+			mirageprefetch_advise(pf, &g_array_index(pf->files, mirageprefetch_file_t, e->first_file),
+					e->offset + (guint64) a * e->sector_size, (guint64) (b - a) * e->sector_size);
+			continue;
+		}
+
+		/* spills over into the next part before the decoder gets there */
+		p0 = e->physical * a / e->length;
+		p1 = e->physical * b / e->length;
+		for (j = e->first_file; j < e->first_file + e->files && p0 < p1; j++) {
+			const mirageprefetch_file_t* const f = &g_array_index(pf->files, mirageprefetch_file_t, j);
+
+			if (p0 < f->size)
+				mirageprefetch_advise(pf, f, p0, MIN(p1, f->size) - p0);
+
+			p0 = p0 > f->size ? p0 - f->size : 0;
+			p1 = p1 > f->size ? p1 - f->size : 0;
+		}
+	}
+}
+
+static gpointer mirageprefetch_thread(gpointer data) {
+	mirageprefetch_t* const pf = data;
+
+	g_mutex_lock(&pf->lock);
+	while (!pf->stop && pf->done < pf->end) {
+		const gint to = MIN(pf->target, pf->end);
+
+		if (to - pf->done < pf->step && to < pf->end) {
+			g_cond_wait(&pf->cond, &pf->lock);
+			continue;
+		}
+
+		g_mutex_unlock(&pf->lock);
+		mirageprefetch_issue(pf, pf->done, to);
+		g_mutex_lock(&pf->lock);
+		pf->done = to;
+	}
+	g_mutex_unlock(&pf->lock);
+
+	return NULL;
+}
+
+/* Starts reading ahead from sector first, if any input was added. */
+gboolean mirageprefetch_start(mirageprefetch_t* const pf, const gint first) {
+	if (!pf->extents->len)
+		return FALSE;
+
+	if (verbose)
+		g_printerr("Reading %d sectors ahead from %u file(s)\n", pf->distance, pf->files->len);
+
+#ifndef POSIX_FADV_WILLNEED
+	pf->scratch = g_malloc(MIRAGEPREFETCH_READ_SIZE);
+#endif
+	pf->done = first;
+	pf->target = first + pf->distance;
+	pf->thread = g_thread_new("prefetch", mirageprefetch_thread, pf);
+	return TRUE;
+}
+
+/* Tells that the decoder got to sector address. */
+void mirageprefetch_advance(mirageprefetch_t* const pf, const gint address) {
+	g_mutex_lock(&pf->lock);
+	pf->target = address + pf->distance;
+	g_cond_signal(&pf->cond);
+	g_mutex_unlock(&pf->lock);
+}
+
+void mirageprefetch_free(mirageprefetch_t* const pf) {
+	guint i;
+
+	if (pf->thread) {
+		g_mutex_lock(&pf->lock);
+		pf->stop = TRUE;
+		g_cond_signal(&pf->cond);
+		g_mutex_unlock(&pf->lock);
+		g_thread_join(pf->thread);
+	}
+
+	for (i = 0; i < pf->files->len; i++) {
+		mirageprefetch_file_t* const f = &g_array_index(pf->files, mirageprefetch_file_t, i);
+
+		close(f->fd);
+		g_free(f->fn);
+	}
+
+	g_array_free(pf->files, TRUE);
+	g_array_free(pf->extents, TRUE);
+	g_cond_clear(&pf->cond);
+	g_mutex_clear(&pf->lock);
+#ifndef POSIX_FADV_WILLNEED
+	g_free(pf->scratch);
+#endif
+	g_free(pf);
+}
@@ -0,0 +1,20 @@
+/* mirage2iso; input read-ahead for conversion
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_PREFETCH_H
+#define _MIRAGE_PREFETCH_H 1
+
+#include <glib.h>
+
+typedef struct mirageprefetch mirageprefetch_t;
+
+mirageprefetch_t* mirageprefetch_new(const gint distance);
+gboolean mirageprefetch_add(mirageprefetch_t* const pf, const gint address, const gint length,
+		const gchar* const fn, const guint64 offset, const gint sector_size);
+gboolean mirageprefetch_start(mirageprefetch_t* const pf, const gint first);
+void mirageprefetch_advance(mirageprefetch_t* const pf, const gint address);
+void mirageprefetch_free(mirageprefetch_t* const pf);
+
+#endif
@@ -0,0 +1,22 @@
+/* mirage2iso; USDT probes
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_PROBES_H
+#define _MIRAGE_PROBES_H 1
+
+/* Probes are in the 'mirage2iso' provider; without --enable-sdt
+ * they expand to nothing, arguments included. */
+#ifdef HAVE_SYS_SDT_H
+#	include <sys/sdt.h>
+#	define MIRAGE_PROBE1(name, a) DTRACE_PROBE1(mirage2iso, name, a)
+#	define MIRAGE_PROBE2(name, a, b) DTRACE_PROBE2(mirage2iso, name, a, b)
+#	define MIRAGE_PROBE3(name, a, b, c) DTRACE_PROBE3(mirage2iso, name, a, b, c)
+#else
+#	define MIRAGE_PROBE1(name, a) do { } while (0)
+#	define MIRAGE_PROBE2(name, a, b) do { } while (0)
+#	define MIRAGE_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,556 @@
+/* mirage2iso; conversion server
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "mirage-password.h"
+#include "mirage-server.h"
+#include "mirage-sysexits.h"
+
+extern gboolean quiet;
+extern gboolean verbose;
+
+/* The protocol is deliberately trivial: the client sends a GKeyFile with
+ * a single [job] group and shuts down its write side. Everything the job
+ * prints on stderr (messages and progress) is streamed back as-is,
+ * and the server terminates the stream with a status line. The job output
+ * need not end with a newline, so the status carries a leading one,
+ * which the client drops. */
+#define MIRAGESRV_GROUP "job"
+#define MIRAGESRV_STATUS "\n\001exit "
+#define MIRAGESRV_MAX_REQUEST 65536
+
+static volatile sig_atomic_t miragesrv_terminate = 0;
+
+static void miragesrv_sighandler(int sig) {
+	/* SIGCHLD only needs to interrupt pselect() */
+	if (sig != SIGCHLD)
+		miragesrv_terminate = 1;
+}
+
+static gboolean miragesrv_write_all(const int fd, const gchar* buf, gsize len) {
+	while (len > 0) {
+		const gssize wr = write(fd, buf, len);
+
+		if (wr == -1) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+
+		buf += wr;
+		len -= wr;
+	}
+
+	return TRUE;
+}
+
+static gboolean miragesrv_fill_addr(const gchar* const path, struct sockaddr_un* const addr) {
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		g_printerr("Socket path too long: %s\n", path);
+		return FALSE;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path, path);
+
+	return TRUE;
+}
+
+int miragesrv_listen_unix(const gchar* const path) {
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd;
+
+	if (!miragesrv_fill_addr(path, &addr))
+		return -1;
+
+	/* replace the socket left behind by a previous instance */
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode) && unlink(path))
+		g_printerr("unlink() failed: %s\n", g_strerror(errno));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		g_printerr("socket() failed: %s\n", g_strerror(errno));
+		return -1;
+	}
+
+	/* jobs run with our privileges, so only we may connect */
+	mask = umask(0077);
+	if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		g_printerr("Unable to bind to '%s': %s\n", path, g_strerror(errno));
+		umask(mask);
+		close(fd);
+		return -1;
+	}
+	umask(mask);
+
+	if (listen(fd, SOMAXCONN) == -1) {
+		g_printerr("listen() failed: %s\n", g_strerror(errno));
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+static gboolean miragesrv_is_loopback(const struct sockaddr* const sa) {
+	if (sa->sa_family == AF_INET)
+		return (ntohl(((const struct sockaddr_in*) sa)->sin_addr.s_addr) >> 24) == 127;
+	if (sa->sa_family == AF_INET6) {
+		const struct in6_addr* const a = &((const struct sockaddr_in6*) sa)->sin6_addr;
+
+		return IN6_IS_ADDR_LOOPBACK(a) || (IN6_IS_ADDR_V4MAPPED(a) && a->s6_addr[12] == 127);
+	}
+	return FALSE;
+}
+
+/* Listens on [host:]port; host defaults to localhost and needs to be
+ * a loopback address, as there is no authentication. */
+int miragesrv_listen_tcp(const gchar* const addr) {
+	const gchar* const sep = strrchr(addr, ':');
+	struct addrinfo hints, *res, *ai;
+	gchar *host;
+	int fd = -1;
+	int gaerr;
+
+	host = sep ? g_strndup(addr, sep - addr) : g_strdup("localhost");
+	/* [::1]:port, as in URLs */
+	if (host[0] == '[' && sep > addr + 1 && sep[-1] == ']') {
+		g_free(host);
+		host = g_strndup(addr + 1, sep - addr - 2);
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((gaerr = getaddrinfo(host, sep ? sep + 1 : addr, &hints, &res))) {
+		g_printerr("Unable to resolve '%s': %s\n", addr, gai_strerror(gaerr));
+		g_free(host);
+		return -1;
+	}
+	g_free(host);
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (!miragesrv_is_loopback(ai->ai_addr)) {
+			g_printerr("Refusing to listen on '%s', only loopback addresses are allowed\n", addr);
+			freeaddrinfo(res);
+			return -1;
+		}
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		const int one = 1;
+
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, SOMAXCONN))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd == -1)
+		g_printerr("Unable to listen on '%s': %s\n", addr, g_strerror(errno));
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void miragesrv_send_status(const int fd, const gint code) {
+	gchar* const msg = g_strdup_printf(MIRAGESRV_STATUS "%d\n", code);
+
+	/* the client may be gone already, nothing to do about that */
+	miragesrv_write_all(fd, msg, strlen(msg));
+	g_free(msg);
+}
+
+static GKeyFile* miragesrv_read_job(const int fd) {
+	GString* const buf = g_string_new(NULL);
+	GKeyFile* req = NULL;
+	GError *err = NULL;
+	gchar rdbuf[4096];
+	gssize rd;
+
+	while ((rd = read(fd, rdbuf, sizeof(rdbuf))) != 0) {
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			g_printerr("Unable to read the job request: %s\n", g_strerror(errno));
+			g_string_free(buf, TRUE);
+			return NULL;
+		}
+
+		g_string_append_len(buf, rdbuf, rd);
+		if (buf->len > MIRAGESRV_MAX_REQUEST) {
+			g_printerr("Job request too large\n");
+			g_string_free(buf, TRUE);
+			return NULL;
+		}
+	}
+
+	req = g_key_file_new();
+	if (!g_key_file_load_from_data(req, buf->str, buf->len, G_KEY_FILE_NONE, &err)) {
+		g_printerr("Malformed job request: %s\n", err->message);
+		g_error_free(err);
+		g_key_file_free(req);
+		req = NULL;
+	}
+
+	/* may contain the password */
+	memset(buf->str, 0, buf->len);
+	g_string_free(buf, TRUE);
+	return req;
+}
+
+/* Runs in the forked child, never returns. */
+static void miragesrv_run_job(const int fd, miragesrv_job_func job) {
+	GKeyFile *req;
+	GError *err = NULL;
+	gchar *in, *out = NULL, *pass;
+	gint session_num = -1;
+	gint ret;
+	int nullfd;
+
+	/* route all messages and progress to the client */
+	if (dup2(fd, fileno(stderr)) == -1)
+		_exit(EX_OSERR);
+	if ((nullfd = open("/dev/null", O_RDONLY)) != -1) {
+		dup2(nullfd, fileno(stdin));
+		close(nullfd);
+	}
+
+	if (!((req = miragesrv_read_job(fd))))
+		_exit(EX_PROTOCOL);
+
+	in = g_key_file_get_string(req, MIRAGESRV_GROUP, "input", &err);
+	if (in)
+		out = g_key_file_get_string(req, MIRAGESRV_GROUP, "output", &err);
+	if (!in || !out) {
+		g_printerr("Incomplete job request: %s\n", err->message);
+		_exit(EX_PROTOCOL);
+	}
+
+	if (g_key_file_has_key(req, MIRAGESRV_GROUP, "session", NULL))
+		session_num = g_key_file_get_integer(req, MIRAGESRV_GROUP, "session", NULL);
+	quiet = g_key_file_get_boolean(req, MIRAGESRV_GROUP, "quiet", NULL);
+	verbose = g_key_file_get_boolean(req, MIRAGESRV_GROUP, "verbose", NULL);
+
+	if (((pass = g_key_file_get_string(req, MIRAGESRV_GROUP, "password", NULL))))
+		mirage_set_password(pass);
+	mirage_disable_password_input();
+	g_key_file_free(req);
+
+	ret = job(in, out, session_num);
+
+	mirage_forget_password();
+	fflush(NULL);
+	_exit(ret);
+}
+
+static void miragesrv_reap(GHashTable* const running, const gboolean block) {
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) > 0) {
+		gpointer fdp;
+		gint code;
+
+		if (WIFEXITED(status))
+			code = WEXITSTATUS(status);
+		else
+			code = EX_SOFTWARE;
+
+		if (g_hash_table_lookup_extended(running, GINT_TO_POINTER(pid), NULL, &fdp)) {
+			const int fd = GPOINTER_TO_INT(fdp);
+
+			if (WIFSIGNALED(status)) {
+				gchar* const msg = g_strdup_printf("\nJob terminated by signal %d\n", WTERMSIG(status));
+				miragesrv_write_all(fd, msg, strlen(msg));
+				g_free(msg);
+			}
+
+			miragesrv_send_status(fd, code);
+			close(fd);
+			g_hash_table_remove(running, GINT_TO_POINTER(pid));
+		}
+
+		if (verbose)
+			g_printerr("Job %d finished with status %d\n", (int) pid, code);
+
+		/* a blocking waitpid() would wait for the next one as well */
+		if (block)
+			break;
+	}
+}
+
+gint miragesrv_serve(const gchar* const path, const gint jobs, miragesrv_job_func job) {
+	GHashTable* const running = g_hash_table_new(g_direct_hash, g_direct_equal);
+	const int sigs[] = { SIGCHLD, SIGINT, SIGTERM };
+	sigset_t blocked, orig;
+	struct sigaction sa;
+	gint ret = EX_OK;
+	gsize i;
+	int lfd;
+
+	if ((lfd = miragesrv_listen_unix(path)) == -1) {
+		g_hash_table_destroy(running);
+		return EX_OSERR;
+	}
+
+	/* keep the signals blocked outside pselect() to avoid missing SIGCHLD */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = miragesrv_sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigemptyset(&blocked);
+	for (i = 0; i < G_N_ELEMENTS(sigs); i++) {
+		sigaddset(&blocked, sigs[i]);
+		sigaction(sigs[i], &sa, NULL);
+	}
+	sigprocmask(SIG_BLOCK, &blocked, &orig);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!quiet)
+		g_printerr("Serving on '%s' with up to %d concurrent jobs\n", path, jobs);
+
+	while (!miragesrv_terminate) {
+		fd_set rfds;
+		pid_t pid;
+		int cfd;
+
+		miragesrv_reap(running, FALSE);
+
+		/* all slots busy; new clients wait in the listen backlog */
+		if (g_hash_table_size(running) >= (guint) jobs) {
+			pselect(0, NULL, NULL, NULL, NULL, &orig);
+			continue;
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(lfd, &rfds);
+		if (pselect(lfd + 1, &rfds, NULL, NULL, NULL, &orig) == -1) {
+			if (errno == EINTR)
+				continue;
+			g_printerr("pselect() failed: %s\n", g_strerror(errno));
+			ret = EX_OSERR;
+			break;
+		}
+
+		if ((cfd = accept(lfd, NULL, NULL)) == -1) {
+			if (errno != EINTR && errno != ECONNABORTED)
+				g_printerr("accept() failed: %s\n", g_strerror(errno));
+			continue;
+		}
+
+#ifdef SO_PEERCRED
+		{
+			struct ucred cred;
+			socklen_t len = sizeof(cred);
+
+			/* the socket is private, but its directory might not be */
+			if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+				cred.uid = (uid_t) -1;
+			if (cred.uid != geteuid()) {
+				if (verbose)
+					g_printerr("Refusing a job from uid %d\n", (int) cred.uid);
+				close(cfd);
+				continue;
+			}
+		}
+#endif
+
+		if ((pid = fork()) == -1) {
+			g_printerr("fork() failed: %s\n", g_strerror(errno));
+			miragesrv_send_status(cfd, EX_OSERR);
+			close(cfd);
+			continue;
+		}
+
+		if (!pid) {
+			GHashTableIter iter;
+			gpointer fd;
+
+			/* the other clients wait for EOF on their connections */
+			close(lfd);
+			g_hash_table_iter_init(&iter, running);
+			while (g_hash_table_iter_next(&iter, NULL, &fd))
+				close(GPOINTER_TO_INT(fd));
+			sa.sa_handler = SIG_DFL;
+			for (i = 0; i < G_N_ELEMENTS(sigs); i++)
+				sigaction(sigs[i], &sa, NULL);
+			signal(SIGPIPE, SIG_DFL);
+			sigprocmask(SIG_SETMASK, &orig, NULL);
+
+			miragesrv_run_job(cfd, job);
+		}
+
+		g_hash_table_insert(running, GINT_TO_POINTER(pid), GINT_TO_POINTER(cfd));
+		if (verbose)
+			g_printerr("Job %d started\n", (int) pid);
+	}
+
+	if (!quiet && g_hash_table_size(running))
+		g_printerr("Waiting for %d running jobs to finish\n", g_hash_table_size(running));
+	while (g_hash_table_size(running))
+		miragesrv_reap(running, TRUE);
+
+	close(lfd);
+	if (unlink(path))
+		g_printerr("unlink() failed: %s\n", g_strerror(errno));
+	g_hash_table_destroy(running);
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+
+	return ret;
+}
+
+static gint miragesrv_relay(const int fd) {
+	GString* const pending = g_string_new(NULL);
+	gint ret = -1;
+	gchar buf[4096];
+	gssize rd;
+
+	while ((rd = read(fd, buf, sizeof(buf))) != 0) {
+		if (rd == -1) {
+			if (errno == EINTR)
+				continue;
+			g_printerr("Connection to the server failed: %s\n", g_strerror(errno));
+			break;
+		}
+
+		g_string_append_len(pending, buf, rd);
+
+		/* pass everything through but the status record, and the tail
+		 * that may turn out to be its beginning */
+		for (;;) {
+			const gchar* const status = strstr(pending->str, MIRAGESRV_STATUS);
+			const gchar* const end = status ? strchr(&status[1], '\n') : NULL;
+			gsize len = status ? (gsize) (status - pending->str) : pending->len;
+
+			if (!status) {
+				const gsize mlen = strlen(MIRAGESRV_STATUS);
+				gsize i;
+
+				for (i = len > mlen ? len - mlen : 0; i < len; i++) {
+					if (!memcmp(&pending->str[i], MIRAGESRV_STATUS, len - i)) {
+						len = i;
+						break;
+					}
+				}
+			}
+
+			fwrite(pending->str, len, 1, stderr);
+			g_string_erase(pending, 0, len);
+			if (!end)
+				break;
+
+			ret = atoi(&pending->str[strlen(MIRAGESRV_STATUS)]);
+			g_string_erase(pending, 0, end - status + 1);
+		}
+	}
+
+	if (pending->len)
+		fwrite(pending->str, pending->len, 1, stderr);
+	g_string_free(pending, TRUE);
+
+	if (ret == -1) {
+		g_printerr("Server closed the connection without reporting job status\n");
+		return EX_PROTOCOL;
+	}
+
+	return ret;
+}
+
+static gchar* miragesrv_abspath(const gchar* const fn) {
+	gchar *cwd, *ret;
+
+	/* the server does not share our working directory */
+	if (g_path_is_absolute(fn))
+		return g_strdup(fn);
+
+	cwd = g_get_current_dir();
+	ret = g_build_filename(cwd, fn, NULL);
+	g_free(cwd);
+	return ret;
+}
+
+gint miragesrv_submit(const gchar* const path, const gchar* const in, const gchar* const out,
+		const gint session_num, const gchar* const pass) {
+	struct sockaddr_un addr;
+	GKeyFile *req;
+	gchar *tmp, *data;
+	gsize len;
+	gint ret;
+	int fd;
+
+	if (!miragesrv_fill_addr(path, &addr))
+		return EX_USAGE;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		g_printerr("socket() failed: %s\n", g_strerror(errno));
+		return EX_OSERR;
+	}
+
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		g_printerr("Unable to connect to '%s': %s\n", path, g_strerror(errno));
+		close(fd);
+		return EX_UNAVAILABLE;
+	}
+
+	req = g_key_file_new();
+	tmp = miragesrv_abspath(in);
+	g_key_file_set_string(req, MIRAGESRV_GROUP, "input", tmp);
+	g_free(tmp);
+	tmp = miragesrv_abspath(out);
+	g_key_file_set_string(req, MIRAGESRV_GROUP, "output", tmp);
+	g_free(tmp);
+	if (session_num != -1)
+		g_key_file_set_integer(req, MIRAGESRV_GROUP, "session", session_num);
+	g_key_file_set_boolean(req, MIRAGESRV_GROUP, "quiet", quiet);
+	g_key_file_set_boolean(req, MIRAGESRV_GROUP, "verbose", verbose);
+	if (pass)
+		g_key_file_set_string(req, MIRAGESRV_GROUP, "password", pass);
+
+	data = g_key_file_to_data(req, &len, NULL);
+	g_key_file_free(req);
+
+	signal(SIGPIPE, SIG_IGN);
+	if (!miragesrv_write_all(fd, data, len) || shutdown(fd, SHUT_WR) == -1) {
+		g_printerr("Unable to send the job request: %s\n", g_strerror(errno));
+		ret = EX_IOERR;
+	} else
+		ret = miragesrv_relay(fd);
+
+	memset(data, 0, len);
+	g_free(data);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,21 @@
+/* mirage2iso; conversion server
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_SERVER_H
+#define _MIRAGE_SERVER_H 1
+
+#include <glib.h>
+
+typedef gint (*miragesrv_job_func)(const gchar* const in, const gchar* const out,
+		const gint session_num);
+
+int miragesrv_listen_unix(const gchar* const path);
+int miragesrv_listen_tcp(const gchar* const addr);
+
+gint miragesrv_serve(const gchar* const path, const gint jobs, miragesrv_job_func job);
+gint miragesrv_submit(const gchar* const path, const gchar* const in, const gchar* const out,
+		const gint session_num, const gchar* const pass);
+
+#endif
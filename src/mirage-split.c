@@ -0,0 +1,347 @@
+/* mirage2iso; --split-size output into fixed-size parts
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mirage-split.h"
+#include "mirage-sysexits.h"
+
+#define MIRAGESPLIT_MANIFEST_MAGIC "mirage2iso-split 1"
+#define MIRAGESPLIT_BUFFER_SIZE (1 << 20)
+/* parts being written can fall this many buffers behind the decoder */
+#define MIRAGESPLIT_BUFFERS 8
+
+extern gboolean verbose;
+
+typedef struct {
+	guint8 *data;
+	gsize len;
+} miragesplit_buffer_t;
+
+typedef struct {
+	miragesplit_t *sp;
+	gchar *fn;
+	FILE *f;
+	guint64 offset, size;
+	GAsyncQueue *queue;
+	GThread *thread;
+	GChecksum *sum;
+	/* errno of the failed write, 0 if none */
+	gint error;
+	/* set when the writer is done and can be joined */
+	gint done;
+} miragesplit_part_t;
+
+struct miragesplit {
+	gchar *fn;
+	guint64 size, part_size;
+	miragesplit_open_func_t open;
+
+	/* parts append to it as they are completed */
+	FILE *manifest;
+	GMutex lock;
+
+	GPtrArray *parts;
+	miragesplit_part_t *current;
+	guint64 pos;
+	GAsyncQueue *idle;
+	miragesplit_buffer_t *buf;
+	/* set by the writers, stops the conversion */
+	gint error;
+};
+
+/* queued after the last buffer of a part */
+static miragesplit_buffer_t miragesplit_eof;
+
+/* Prepares writing size bytes into fn.000, fn.001, ... and fn.manifest. */
+miragesplit_t* miragesplit_new(const gchar* const fn, const guint64 size, const guint64 part_size,
+		miragesplit_open_func_t open) {
+	miragesplit_t *sp;
+	gchar* const manifest = g_strdup_printf("%s.manifest", fn);
+	FILE* const f = fopen(manifest, "w");
+	gint i;
+
+	if (!f) {
+		g_printerr("Unable to open manifest file '%s': %s\n", manifest, g_strerror(errno));
+		g_free(manifest);
+		return NULL;
+	}
+	g_free(manifest);
+
+	fprintf(f, MIRAGESPLIT_MANIFEST_MAGIC "\nsize %" G_GUINT64_FORMAT "\npart-size %" G_GUINT64_FORMAT "\n",
+			size, part_size);
+	fflush(f);
+
+	sp = g_new0(miragesplit_t, 1);
+	sp->fn = g_strdup(fn);
+	sp->size = size;
+	sp->part_size = part_size;
+	sp->open = open;
+	sp->manifest = f;
+	g_mutex_init(&sp->lock);
+	sp->parts = g_ptr_array_new();
+	sp->idle = g_async_queue_new();
+	for (i = 0; i < MIRAGESPLIT_BUFFERS; i++) {
+		miragesplit_buffer_t* const b = g_new(miragesplit_buffer_t, 1);
+
+		b->data = g_malloc(MIRAGESPLIT_BUFFER_SIZE);
+		g_async_queue_push(sp->idle, b);
+	}
+
+	return sp;
+}
+
+static gpointer miragesplit_writer(gpointer data) {
+	miragesplit_part_t* const p = data;
+	miragesplit_t* const sp = p->sp;
+	miragesplit_buffer_t *b;
+	guint64 written = 0;
+	gint err = 0;
+
+	while ((b = g_async_queue_pop(p->queue)) != &miragesplit_eof) {
+		/* a failed part keeps releasing buffers until the decoder stops */
+		if (!err && fwrite(b->data, 1, b->len, p->f) != b->len)
+			err = ferror(p->f) && errno ? errno : EIO;
+		else if (!err) {
+			g_checksum_update(p->sum, b->data, b->len);
+			written += b->len;
+		}
+
+		g_async_queue_push(sp->idle, b);
+	}
+
+	if (fclose(p->f) && !err)
+		err = errno;
+	p->f = NULL;
+
+	/* a part cut short by a failed conversion is not listed */
+	g_mutex_lock(&sp->lock);
+	if (!err && written == p->size) {
+		gchar* const base = g_path_get_basename(p->fn);
+
+		fprintf(sp->manifest, "%s %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %s\n",
+				g_checksum_get_string(p->sum), p->offset, p->size, base);
+		if (fflush(sp->manifest))
+			err = errno;
+		g_free(base);
+	}
+
+	if (err) {
+		p->error = err;
+		if (!g_atomic_int_get(&sp->error))
+			g_atomic_int_set(&sp->error, err);
+	}
+	g_mutex_unlock(&sp->lock);
+
+	g_atomic_int_set(&p->done, TRUE);
+	return NULL;
+}
+
+/* Joins the writers of completed parts, releasing their resources;
+ * all writers if all is set. */
+static void miragesplit_reap(miragesplit_t* const sp, const gboolean all) {
+	guint i;
+
+	for (i = 0; i < sp->parts->len; i++) {
+		miragesplit_part_t* const p = g_ptr_array_index(sp->parts, i);
+
+		if (!p->thread || (!all && !g_atomic_int_get(&p->done)))
+			continue;
+
+		g_thread_join(p->thread);
+		p->thread = NULL;
+		g_async_queue_unref(p->queue);
+		p->queue = NULL;
+		g_checksum_free(p->sum);
+		p->sum = NULL;
+	}
+}
+
+/* Opens the part starting at the current position and starts its writer. */
+static gboolean miragesplit_next(miragesplit_t* const sp) {
+	miragesplit_part_t *p;
+
+	/* only the parts still holding buffers have their writers around */
+	miragesplit_reap(sp, FALSE);
+
+	if (sp->pos >= sp->size) {
+		errno = EFBIG;
+		return FALSE;
+	}
+
+	p = g_new0(miragesplit_part_t, 1);
+	p->sp = sp;
+	p->fn = g_strdup_printf("%s.%03u", sp->fn, sp->parts->len);
+	p->offset = sp->pos;
+	p->size = MIN(sp->part_size, sp->size - sp->pos);
+
+	if (sp->open(p->fn, p->size, &p->f)) {
+		const gint err = errno;
+
+		if (p->f) {
+			if (fclose(p->f))
+				g_printerr("fclose() failed: %s", g_strerror(errno));
+			/* We probably ate the whole disk space, so unlink the file. */
+			if (remove(p->fn))
+				g_printerr("remove() failed: %s", g_strerror(errno));
+		}
+
+		g_free(p->fn);
+		g_free(p);
+		errno = err;
+		return FALSE;
+	}
+
+	if (verbose)
+		g_printerr("Part '%s' open for bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "\n",
+				p->fn, p->offset, p->offset + p->size - 1);
+
+	p->queue = g_async_queue_new();
+	p->sum = g_checksum_new(G_CHECKSUM_SHA256);
+	p->thread = g_thread_new("split", &miragesplit_writer, p);
+	g_ptr_array_add(sp->parts, p);
+	sp->current = p;
+	return TRUE;
+}
+
+/* miragewrap_write_func_t; each part is handed to its writer as it is decoded. */
+gboolean miragesplit_write(const guint8* const buf, const gsize len, gpointer user_data) {
+	miragesplit_t* const sp = user_data;
+	gsize pos = 0;
+
+	while (pos < len) {
+		const gint err = g_atomic_int_get(&sp->error);
+		guint64 end;
+		gsize n;
+
+		if (err) {
+			errno = err;
+			return FALSE;
+		}
+
+		if (!sp->current && !miragesplit_next(sp))
+			return FALSE;
+		if (!sp->buf) {
+			sp->buf = g_async_queue_pop(sp->idle);
+			sp->buf->len = 0;
+		}
+
+		/* buffers never span parts */
+		end = sp->current->offset + sp->current->size;
+		n = MIN(len - pos, MIRAGESPLIT_BUFFER_SIZE - sp->buf->len);
+		n = MIN(n, end - sp->pos);
+		memcpy(&sp->buf->data[sp->buf->len], &buf[pos], n);
+		sp->buf->len += n;
+		sp->pos += n;
+		pos += n;
+
+		if (sp->buf->len == MIRAGESPLIT_BUFFER_SIZE || sp->pos == end) {
+			g_async_queue_push(sp->current->queue, sp->buf);
+			sp->buf = NULL;
+		}
+		if (sp->pos == end) {
+			g_async_queue_push(sp->current->queue, &miragesplit_eof);
+			sp->current = NULL;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Closes the manifest, ending it with an 'incomplete' line unless all
+ * the parts were written. */
+static gboolean miragesplit_close_manifest(miragesplit_t* const sp, const gboolean complete) {
+	gboolean ok = TRUE;
+
+	if (!complete)
+		fputs("incomplete\n", sp->manifest);
+	if (fclose(sp->manifest)) {
+		g_printerr("fclose() failed: %s", g_strerror(errno));
+		ok = FALSE;
+	}
+	sp->manifest = NULL;
+
+	return ok;
+}
+
+static void miragesplit_join(miragesplit_t* const sp) {
+	if (sp->buf) {
+		g_async_queue_push(sp->current->queue, sp->buf);
+		sp->buf = NULL;
+	}
+	if (sp->current) {
+		g_async_queue_push(sp->current->queue, &miragesplit_eof);
+		sp->current = NULL;
+	}
+
+	miragesplit_reap(sp, TRUE);
+}
+
+/* Waits for all the parts to be written and closes the manifest.
+ * Returns EX_IOERR if writing any of them failed. */
+gint miragesplit_finish(miragesplit_t* const sp) {
+	gint ret = EX_OK;
+	guint i;
+
+	miragesplit_join(sp);
+
+	for (i = 0; i < sp->parts->len; i++) {
+		miragesplit_part_t* const p = g_ptr_array_index(sp->parts, i);
+
+		if (p->error) {
+			g_printerr("Writing part '%s' failed: %s\n", p->fn, g_strerror(p->error));
+			ret = EX_IOERR;
+		}
+	}
+
+	if (sp->pos < sp->size) {
+		g_printerr("Only %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes were written\n", sp->pos, sp->size);
+		ret = EX_IOERR;
+	}
+
+	if (!miragesplit_close_manifest(sp, ret == EX_OK))
+		ret = EX_IOERR;
+	else if (verbose && ret == EX_OK)
+		g_printerr("%u parts written, manifest in '%s.manifest'\n", sp->parts->len, sp->fn);
+
+	return ret;
+}
+
+void miragesplit_free(miragesplit_t* const sp) {
+	guint i;
+
+	miragesplit_join(sp);
+
+	for (i = 0; i < sp->parts->len; i++) {
+		miragesplit_part_t* const p = g_ptr_array_index(sp->parts, i);
+
+		g_free(p->fn);
+		g_free(p);
+	}
+	g_ptr_array_free(sp->parts, TRUE);
+
+	/* not finished, the conversion failed */
+	if (sp->manifest)
+		miragesplit_close_manifest(sp, FALSE);
+
+	for (i = 0; i < MIRAGESPLIT_BUFFERS; i++) {
+		miragesplit_buffer_t* const b = g_async_queue_pop(sp->idle);
+
+		g_free(b->data);
+		g_free(b);
+	}
+	g_async_queue_unref(sp->idle);
+	g_mutex_clear(&sp->lock);
+	g_free(sp->fn);
+	g_free(sp);
+}
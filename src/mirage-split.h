@@ -0,0 +1,23 @@
+/* mirage2iso; --split-size output into fixed-size parts
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_SPLIT_H
+#define _MIRAGE_SPLIT_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef struct miragesplit miragesplit_t;
+/* opens and preallocates a part, returning an EX_* code */
+typedef gint (*miragesplit_open_func_t)(const gchar* const fn, const gsize size, FILE** const f);
+
+miragesplit_t* miragesplit_new(const gchar* const fn, const guint64 size, const guint64 part_size,
+		miragesplit_open_func_t open);
+gboolean miragesplit_write(const guint8* const buf, const gsize len, gpointer user_data);
+gint miragesplit_finish(miragesplit_t* const sp);
+void miragesplit_free(miragesplit_t* const sp);
+
+#endif
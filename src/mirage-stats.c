@@ -0,0 +1,170 @@
+/* mirage2iso; --stats instrumentation
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "mirage-stats.h"
+
+/* latency buckets: [2^i, 2^(i+1)) nanoseconds, the last one open */
+#define MIRAGESTATS_BUCKETS 40
+
+typedef struct {
+	guint64 calls;
+	guint64 sectors;
+	guint64 bytes;
+	gint64 wall;
+	gint64 cpu;
+	guint64 hist[MIRAGESTATS_BUCKETS];
+} miragestats_counter_t;
+
+static const gchar* const miragestats_names[miragestats_phase_count] = {
+	"init", "open", "read", "decode", "write"
+};
+
+gboolean miragestats_enabled = FALSE;
+static gboolean miragestats_json;
+static gint64 miragestats_start;
+static miragestats_counter_t miragestats_counters[miragestats_phase_count];
+/* the cache decodes in its read-ahead thread */
+static GMutex miragestats_lock;
+
+static gint64 miragestats_clock(const clockid_t clock) {
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+void miragestats_enable(const gboolean json) {
+	miragestats_enabled = TRUE;
+	miragestats_json = json;
+	miragestats_start = miragestats_clock(CLOCK_MONOTONIC);
+}
+
+void miragestats_begin(miragestats_mark_t* const mark) {
+	if (!miragestats_enabled)
+		return;
+
+	mark->wall = miragestats_clock(CLOCK_MONOTONIC);
+	mark->cpu = miragestats_clock(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void miragestats_end(const miragestats_mark_t* const mark, const miragestats_phase_t phase,
+		const guint64 sectors, const guint64 bytes) {
+	miragestats_counter_t* const c = &miragestats_counters[phase];
+	gint64 wall, cpu;
+	gint bucket = 0;
+
+	if (!miragestats_enabled)
+		return;
+
+	wall = miragestats_clock(CLOCK_MONOTONIC) - mark->wall;
+	cpu = miragestats_clock(CLOCK_THREAD_CPUTIME_ID) - mark->cpu;
+	while (bucket < MIRAGESTATS_BUCKETS - 1 && wall >> (bucket + 1))
+		bucket++;
+
+	g_mutex_lock(&miragestats_lock);
+	c->calls++;
+	c->sectors += sectors;
+	c->bytes += bytes;
+	c->wall += wall;
+	c->cpu += cpu;
+	c->hist[bucket]++;
+	g_mutex_unlock(&miragestats_lock);
+}
+
+static void miragestats_report_text(FILE* const f, const struct rusage* const ru, const gdouble wall) {
+	gint i, j;
+
+	fprintf(f, "%-8s %10s %12s %14s %10s %10s\n",
+			"phase", "calls", "sectors", "bytes", "wall [s]", "CPU [s]");
+	for (i = 0; i < miragestats_phase_count; i++) {
+		const miragestats_counter_t* const c = &miragestats_counters[i];
+
+		if (c->calls)
+			fprintf(f, "%-8s %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT " %14" G_GUINT64_FORMAT
+					" %10.3f %10.3f\n", miragestats_names[i], c->calls, c->sectors, c->bytes,
+					c->wall / 1e9, c->cpu / 1e9);
+	}
+
+	fprintf(f, "\nlatency per call:\n");
+	for (i = 0; i < miragestats_phase_count; i++) {
+		const miragestats_counter_t* const c = &miragestats_counters[i];
+
+		for (j = 0; j < MIRAGESTATS_BUCKETS; j++) {
+			if (c->hist[j])
+				fprintf(f, "%-8s < %12.3f ms %12" G_GUINT64_FORMAT "\n", miragestats_names[i],
+						((gint64) 2 << j) / 1e6, c->hist[j]);
+		}
+	}
+
+	fprintf(f, "\ntotal: %.3f s wall, %ld.%03ld s user, %ld.%03ld s system\n"
+			"peak RSS: %ld KiB, page faults: %ld minor, %ld major\n",
+			wall, (glong) ru->ru_utime.tv_sec, (glong) ru->ru_utime.tv_usec / 1000,
+			(glong) ru->ru_stime.tv_sec, (glong) ru->ru_stime.tv_usec / 1000,
+			ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt);
+}
+
+static void miragestats_report_json(FILE* const f, const struct rusage* const ru, const gdouble wall) {
+	gint i, j;
+
+	fprintf(f, "{\"phases\": {");
+	for (i = 0; i < miragestats_phase_count; i++) {
+		const miragestats_counter_t* const c = &miragestats_counters[i];
+		gboolean first = TRUE;
+
+		fprintf(f, "%s\"%s\": {\"calls\": %" G_GUINT64_FORMAT ", \"sectors\": %" G_GUINT64_FORMAT
+				", \"bytes\": %" G_GUINT64_FORMAT ", \"wall_s\": %.6f, \"cpu_s\": %.6f, \"latency_ns\": {",
+				i ? ", " : "", miragestats_names[i], c->calls, c->sectors, c->bytes,
+				c->wall / 1e9, c->cpu / 1e9);
+		/* keyed by the bucket's upper bound */
+		for (j = 0; j < MIRAGESTATS_BUCKETS; j++) {
+			if (c->hist[j]) {
+				fprintf(f, "%s\"%" G_GINT64_FORMAT "\": %" G_GUINT64_FORMAT,
+						first ? "" : ", ", (gint64) 2 << j, c->hist[j]);
+				first = FALSE;
+			}
+		}
+		fprintf(f, "}}");
+	}
+
+	fprintf(f, "}, \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+			"\"max_rss_kib\": %ld, \"minor_faults\": %ld, \"major_faults\": %ld}\n",
+			wall, ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+			ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+			ru->ru_maxrss, ru->ru_minflt, ru->ru_majflt);
+}
+
+void miragestats_report(FILE* const f) {
+	struct rusage ru;
+	gdouble wall;
+
+	if (!miragestats_enabled)
+		return;
+
+	wall = (miragestats_clock(CLOCK_MONOTONIC) - miragestats_start) / 1e9;
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		g_printerr("getrusage() failed: %s\n", g_strerror(errno));
+		return;
+	}
+
+	g_mutex_lock(&miragestats_lock);
+	if (miragestats_json)
+		miragestats_report_json(f, &ru, wall);
+	else
+		miragestats_report_text(f, &ru, wall);
+	g_mutex_unlock(&miragestats_lock);
+}
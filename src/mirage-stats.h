@@ -0,0 +1,35 @@
+/* mirage2iso; --stats instrumentation
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_STATS_H
+#define _MIRAGE_STATS_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef enum {
+	miragestats_init,
+	miragestats_open,
+	miragestats_read,
+	miragestats_decode,
+	miragestats_write,
+	miragestats_phase_count
+} miragestats_phase_t;
+
+typedef struct {
+	gint64 wall;
+	gint64 cpu;
+} miragestats_mark_t;
+
+extern gboolean miragestats_enabled;
+
+void miragestats_enable(const gboolean json);
+void miragestats_begin(miragestats_mark_t* const mark);
+void miragestats_end(const miragestats_mark_t* const mark, const miragestats_phase_t phase,
+		const guint64 sectors, const guint64 bytes);
+void miragestats_report(FILE* const f);
+
+#endif
@@ -0,0 +1,749 @@
+/* mirage2iso; single-pass conversion of streamed input
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#	include <zlib.h>
+#endif
+
+#include "mirage-check.h"
+#include "mirage-ecc.h"
+#include "mirage-stats.h"
+#include "mirage-stream.h"
+#include "mirage-sysexits.h"
+
+extern gboolean quiet;
+extern gboolean verbose;
+
+/* size of a single read from the input and of a single output write */
+#define MIRAGESTREAM_BUF_SIZE (1 << 20)
+/* enough to see the 'CD001' identifier of the first volume descriptor */
+#define MIRAGESTREAM_SNIFF_SIZE 0x8006
+
+typedef enum {
+	miragestream_spill_only,
+	miragestream_plain,
+	miragestream_raw,
+	miragestream_ecm,
+	miragestream_cso
+} miragestream_format_t;
+
+struct miragestream {
+	FILE *in;
+	miragestream_format_t format;
+	gint ret;
+
+	/* data read while detecting the format, consumed before 'in' */
+	guint8 *head;
+	gsize head_len, head_pos;
+	guint8 *ibuf;
+
+	/* 2048 for plain data, 2336 or 2352 for raw sectors, 0 if not known yet */
+	gint sector_size;
+	guint8 sector[2352];
+	gsize sector_fill;
+	gint sector_num;
+	gboolean data_end;
+
+	FILE *out;
+	guint8 *obuf;
+	gsize ofill;
+	guint64 written;
+	void (*report_progress)(gint, gint, gint);
+
+	/* output size, if known in advance */
+	guint64 size;
+
+	/* CSO */
+	guint32 *index;
+	guint32 blocks;
+	guint32 block_size;
+	guint align;
+};
+
+static const guint8 miragestream_sync[12] = {
+	0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00
+};
+
+static guint32 miragestream_le32(const guint8* const p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32) p[3] << 24);
+}
+
+/* Makes sure at least len bytes (or the whole input) are in the head buffer. */
+static gboolean miragestream_fill(miragestream_t* const st, const gsize len) {
+	if (st->head_len >= len)
+		return TRUE;
+
+	st->head = g_realloc(st->head, len);
+	st->head_len += fread(&st->head[st->head_len], 1, len - st->head_len, st->in);
+
+	if (ferror(st->in)) {
+		g_printerr("Reading input failed: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gsize miragestream_read(miragestream_t* const st, guint8* const buf, const gsize len) {
+	gsize done = 0;
+
+	if (st->head) {
+		done = MIN(len, st->head_len - st->head_pos);
+		memcpy(buf, &st->head[st->head_pos], done);
+		st->head_pos += done;
+
+		if (st->head_pos == st->head_len) {
+			g_free(st->head);
+			st->head = NULL;
+		}
+	}
+
+	if (done < len)
+		done += fread(&buf[done], 1, len - done, st->in);
+
+	return done;
+}
+
+static gboolean miragestream_read_exact(miragestream_t* const st, guint8* const buf, const gsize len) {
+	if (miragestream_read(st, buf, len) == len)
+		return TRUE;
+
+	if (ferror(st->in)) {
+		g_printerr("Reading input failed: %s\n", g_strerror(errno));
+		st->ret = EX_IOERR;
+	} else {
+		g_printerr("Unexpected end of input stream\n");
+		st->ret = EX_DATAERR;
+	}
+
+	return FALSE;
+}
+
+static gboolean miragestream_flush(miragestream_t* const st) {
+	miragestats_mark_t mark;
+
+	if (!st->ofill)
+		return TRUE;
+
+	miragestats_begin(&mark);
+	if (fwrite(st->obuf, 1, st->ofill, st->out) != st->ofill) {
+		g_printerr("Write failed: %s\n", g_strerror(errno));
+		st->ret = EX_IOERR;
+		return FALSE;
+	}
+	miragestats_end(&mark, miragestats_write, st->ofill / 2048, st->ofill);
+
+	st->written += st->ofill;
+	st->ofill = 0;
+
+	if (!quiet && st->size)
+		st->report_progress(0, st->written / 2048, st->size / 2048);
+
+	return TRUE;
+}
+
+static gboolean miragestream_write(miragestream_t* const st, const guint8* buf, gsize len) {
+	while (len) {
+		const gsize n = MIN(len, MIRAGESTREAM_BUF_SIZE - st->ofill);
+
+		memcpy(&st->obuf[st->ofill], buf, n);
+		st->ofill += n;
+		buf += n;
+		len -= n;
+
+		if (st->ofill == MIRAGESTREAM_BUF_SIZE && !miragestream_flush(st))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Outputs the user data of a single raw sector. */
+static gboolean miragestream_put_sector(miragestream_t* const st, const guint8* const s) {
+	const guint8 *data = NULL;
+	guint8 submode = 0;
+
+	if (st->sector_size == 2352) {
+		if (memcmp(s, miragestream_sync, sizeof(miragestream_sync)))
+			;
+		else if (s[15] == 1)
+			data = &s[16];
+		else if (s[15] == 2) {
+			submode = s[18];
+			data = &s[24];
+		}
+	} else {
+		submode = s[2];
+		data = &s[8];
+	}
+
+	if (submode & 0x20) {
+		g_printerr("Mode 2 Form 2 sector found, it can't be stored in an .iso\n");
+		st->ret = EX_DATAERR;
+		return FALSE;
+	}
+
+	if (!data) {
+		if (!st->written && !st->ofill) {
+			g_printerr("No supported track found (audio CD?)\n");
+			st->ret = EX_DATAERR;
+			return FALSE;
+		}
+
+		/* like with images, only the first data track is output */
+		if (verbose)
+			g_printerr("End of data track found, ignoring the rest of input\n");
+		st->data_end = TRUE;
+		return TRUE;
+	}
+
+	if (miragecheck_enabled) {
+		guint8* const raw = miragecheck_slot();
+		guint8 fixed[2048];
+
+		if (st->sector_size == 2352)
+			memcpy(raw, s, 2352);
+		else {
+			/* Mode 2 EDC/ECC does not cover the header */
+			memcpy(raw, miragestream_sync, sizeof(miragestream_sync));
+			memset(&raw[12], 0, 3);
+			raw[15] = 2;
+			memcpy(&raw[16], s, 2336);
+		}
+
+		if (miragecheck_commit(st->sector_num++, data == &s[16]
+					? mirageecc_mode1 : mirageecc_mode2_form1, fixed))
+			return miragestream_write(st, fixed, 2048);
+	}
+
+	return miragestream_write(st, data, 2048);
+}
+
+/* Outputs decoded image data, extracting user data from raw sectors. */
+static gboolean miragestream_put(miragestream_t* const st, const guint8* buf, gsize len) {
+	while (len && !st->data_end) {
+		gsize n;
+
+		if (!st->sector_size) {
+			n = MIN(len, 16 - st->sector_fill);
+			memcpy(&st->sector[st->sector_fill], buf, n);
+			st->sector_fill += n;
+			buf += n;
+			len -= n;
+
+			if (st->sector_fill == 16) {
+				st->sector_size = memcmp(st->sector, miragestream_sync,
+						sizeof(miragestream_sync)) ? 2048 : 2352;
+				if (verbose)
+					g_printerr("Decoded stream uses %d-byte sectors\n", st->sector_size);
+
+				if (st->sector_size == 2048) {
+					st->sector_fill = 0;
+					if (!miragestream_write(st, st->sector, 16))
+						return FALSE;
+				}
+			}
+		} else if (st->sector_size == 2048)
+			return miragestream_write(st, buf, len);
+		else if (!st->sector_fill && len >= (gsize) st->sector_size) {
+			if (!miragestream_put_sector(st, buf))
+				return FALSE;
+			buf += st->sector_size;
+			len -= st->sector_size;
+		} else {
+			n = MIN(len, st->sector_size - st->sector_fill);
+			memcpy(&st->sector[st->sector_fill], buf, n);
+			st->sector_fill += n;
+			buf += n;
+			len -= n;
+
+			if (st->sector_fill == (gsize) st->sector_size) {
+				st->sector_fill = 0;
+				if (!miragestream_put_sector(st, st->sector))
+					return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean miragestream_finish(miragestream_t* const st) {
+	if (st->sector_fill) {
+		if (!st->sector_size) {
+			/* too short to tell, so it is not raw */
+			if (!miragestream_write(st, st->sector, st->sector_fill))
+				return FALSE;
+		} else if (!quiet)
+			g_printerr("Input ends with an incomplete sector, ignoring it\n");
+	}
+
+	return miragestream_flush(st);
+}
+
+static gboolean miragestream_convert_plain(miragestream_t* const st) {
+	miragestats_mark_t mark;
+	gsize n;
+
+	for (;;) {
+		miragestats_begin(&mark);
+		if (st->data_end || !((n = miragestream_read(st, st->ibuf, MIRAGESTREAM_BUF_SIZE))))
+			break;
+		miragestats_end(&mark, miragestats_read, 0, n);
+
+		if (!miragestream_put(st, st->ibuf, n))
+			return FALSE;
+	}
+
+	if (ferror(st->in)) {
+		g_printerr("Reading input failed: %s\n", g_strerror(errno));
+		st->ret = EX_IOERR;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* ECM records: a type/count header followed by sector data with sync,
+ * EDC and ECC stripped, terminated by a checksum of the whole output. */
+static gboolean miragestream_convert_ecm(miragestream_t* const st) {
+	guint8 sector[2352];
+	guint32 edc = 0;
+
+	if (!miragestream_read_exact(st, sector, 4))
+		return FALSE;
+
+	while (!st->data_end) {
+		guint64 count;
+		guint8 b, type;
+		gint bits = 5;
+
+		if (!miragestream_read_exact(st, &b, 1))
+			return FALSE;
+
+		type = b & 3;
+		count = (b >> 2) & 0x1f;
+		while (b & 0x80) {
+			if (bits > 33 || !miragestream_read_exact(st, &b, 1)) {
+				if (bits > 33) {
+					g_printerr("Malformed ECM record header\n");
+					st->ret = EX_DATAERR;
+				}
+				return FALSE;
+			}
+			count |= (guint64) (b & 0x7f) << bits;
+			bits += 7;
+		}
+
+		if (count == 0xffffffff)
+			break;
+		count++;
+
+		while (count && !st->data_end) {
+			const guint8 *data = &sector[16];
+			gsize len = 2336;
+			guint64 done = 1;
+
+			switch (type) {
+				case 0:
+					done = len = MIN(count, MIRAGESTREAM_BUF_SIZE);
+					data = st->ibuf;
+					if (!miragestream_read_exact(st, st->ibuf, len))
+						return FALSE;
+					break;
+				case 1:
+					memcpy(sector, miragestream_sync, sizeof(miragestream_sync));
+					sector[15] = 1;
+					if (!miragestream_read_exact(st, &sector[12], 3)
+							|| !miragestream_read_exact(st, &sector[16], 2048))
+						return FALSE;
+					mirageecc_generate(sector, mirageecc_mode1);
+					data = sector;
+					len = 2352;
+					break;
+				case 2:
+					if (!miragestream_read_exact(st, &sector[20], 2052))
+						return FALSE;
+					memcpy(&sector[16], &sector[20], 4);
+					mirageecc_generate(sector, mirageecc_mode2_form1);
+					break;
+				case 3:
+					if (!miragestream_read_exact(st, &sector[20], 2328))
+						return FALSE;
+					memcpy(&sector[16], &sector[20], 4);
+					mirageecc_generate(sector, mirageecc_mode2_form2);
+					break;
+			}
+
+			edc = mirageecc_edc(edc, data, len);
+			if (!miragestream_put(st, data, len))
+				return FALSE;
+			count -= done;
+		}
+	}
+
+	/* the rest of the image is not verified if we stopped early */
+	if (!st->data_end) {
+		if (!miragestream_read_exact(st, sector, 4))
+			return FALSE;
+
+		if (miragestream_le32(sector) != edc) {
+			g_printerr("ECM checksum mismatch, the output is corrupted\n");
+			st->ret = EX_DATAERR;
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+#ifdef HAVE_ZLIB
+/* CSO header: 'CISO', header size, total bytes (64-bit), block size,
+ * version, index alignment shift, then (blocks + 1) 32-bit offsets */
+#define MIRAGESTREAM_CSO_HEADER 24
+#define MIRAGESTREAM_CSO_PLAIN 0x80000000
+
+static gboolean miragestream_probe_cso(miragestream_t* const st) {
+	const guint8 *h;
+	guint64 blocks, prev = 0;
+	gsize index_len;
+	guint32 i;
+
+	if (!miragestream_fill(st, MIRAGESTREAM_CSO_HEADER) || st->head_len < MIRAGESTREAM_CSO_HEADER)
+		return FALSE;
+
+	h = st->head;
+	st->size = miragestream_le32(&h[8]) | ((guint64) miragestream_le32(&h[12]) << 32);
+	st->block_size = miragestream_le32(&h[16]);
+	st->align = h[21];
+
+	/* version 2 uses a different block format, leave it to libmirage */
+	if (h[20] > 1 || !st->size || !st->block_size || st->block_size % 2048 || st->align > 31)
+		return FALSE;
+
+	blocks = (st->size + st->block_size - 1) / st->block_size;
+	if (blocks >= G_MAXUINT32 / 4)
+		return FALSE;
+	st->blocks = blocks;
+
+	index_len = MIRAGESTREAM_CSO_HEADER + (st->blocks + 1) * 4;
+	if (!miragestream_fill(st, index_len) || st->head_len < index_len)
+		return FALSE;
+
+	h = &st->head[MIRAGESTREAM_CSO_HEADER];
+	st->index = g_new(guint32, st->blocks + 1);
+	for (i = 0; i <= st->blocks; i++) {
+		const guint64 pos = (guint64) (miragestream_le32(&h[i * 4]) & ~MIRAGESTREAM_CSO_PLAIN) << st->align;
+
+		/* blocks need to be stored in order for a single pass */
+		if (pos < prev || pos < index_len) {
+			if (verbose)
+				g_printerr("CSO blocks are not stored sequentially\n");
+			return FALSE;
+		}
+		st->index[i] = miragestream_le32(&h[i * 4]);
+		prev = pos;
+	}
+
+	st->head_pos = index_len;
+	return TRUE;
+}
+
+static gboolean miragestream_skip(miragestream_t* const st, guint64 len) {
+	while (len) {
+		const gsize n = MIN(len, MIRAGESTREAM_BUF_SIZE);
+
+		if (!miragestream_read_exact(st, st->ibuf, n))
+			return FALSE;
+		len -= n;
+	}
+
+	return TRUE;
+}
+
+static gboolean miragestream_convert_cso(miragestream_t* const st) {
+	guint64 pos = MIRAGESTREAM_CSO_HEADER + (st->blocks + 1) * 4;
+	guint64 remaining = st->size;
+	guint8 *block = g_malloc(st->block_size);
+	gboolean ret = TRUE;
+	z_stream zs;
+	guint32 i;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, -15) != Z_OK) {
+		g_printerr("inflateInit2() failed\n");
+		st->ret = EX_SOFTWARE;
+		g_free(block);
+		return FALSE;
+	}
+
+	for (i = 0; ret && i < st->blocks && !st->data_end; i++) {
+		const guint64 start = (guint64) (st->index[i] & ~MIRAGESTREAM_CSO_PLAIN) << st->align;
+		const guint64 end = (guint64) (st->index[i + 1] & ~MIRAGESTREAM_CSO_PLAIN) << st->align;
+		const gsize bsize = MIN(remaining, st->block_size);
+
+		/* compressed blocks never exceed the input buffer */
+		if (end - start > MIRAGESTREAM_BUF_SIZE
+				|| ((st->index[i] & MIRAGESTREAM_CSO_PLAIN) && end - start < bsize)) {
+			g_printerr("Malformed CSO block %u\n", i);
+			st->ret = EX_DATAERR;
+			ret = FALSE;
+		} else if (!miragestream_skip(st, start - pos)
+				|| !miragestream_read_exact(st, st->ibuf, end - start))
+			ret = FALSE;
+		else if (st->index[i] & MIRAGESTREAM_CSO_PLAIN)
+			ret = miragestream_put(st, st->ibuf, bsize);
+		else {
+			gint zret;
+
+			inflateReset(&zs);
+			zs.next_in = st->ibuf;
+			zs.avail_in = end - start;
+			zs.next_out = block;
+			zs.avail_out = bsize;
+
+			zret = inflate(&zs, Z_FINISH);
+			if ((zret != Z_STREAM_END && zret != Z_OK && zret != Z_BUF_ERROR) || zs.avail_out) {
+				g_printerr("Unable to decompress CSO block %u\n", i);
+				st->ret = EX_DATAERR;
+				ret = FALSE;
+			} else
+				ret = miragestream_put(st, block, bsize);
+		}
+
+		pos = end;
+		remaining -= bsize;
+	}
+
+	inflateEnd(&zs);
+	g_free(block);
+	return ret;
+}
+#endif
+
+/* Reads the beginning of the input to find whether it can be converted
+ * in a single pass. Non-zero sector_size forces raw sectors of that size. */
+miragestream_t* miragestream_open(FILE* const in, const gint sector_size) {
+	miragestream_t* const st = g_new0(miragestream_t, 1);
+	const guint8 *h;
+
+	st->in = in;
+	if (!miragestream_fill(st, MIRAGESTREAM_SNIFF_SIZE)) {
+		miragestream_free(st);
+		return NULL;
+	}
+	h = st->head;
+
+	if (st->head_len >= 4 && !memcmp(h, "ECM\0", 4)) {
+		st->format = miragestream_ecm;
+		st->sector_size = sector_size;
+	} else if (st->head_len >= 4 && !memcmp(h, "CISO", 4)) {
+#ifdef HAVE_ZLIB
+		if (miragestream_probe_cso(st)) {
+			st->format = miragestream_cso;
+			st->sector_size = 2048;
+		}
+#endif
+	} else if (sector_size) {
+		st->format = sector_size == 2048 ? miragestream_plain : miragestream_raw;
+		st->sector_size = sector_size;
+	} else if (st->head_len >= 16 && !memcmp(h, miragestream_sync, sizeof(miragestream_sync))) {
+		st->format = miragestream_raw;
+		st->sector_size = 2352;
+	} else if (st->head_len >= MIRAGESTREAM_SNIFF_SIZE && !memcmp(&h[0x8001], "CD001", 5)) {
+		st->format = miragestream_plain;
+		st->sector_size = 2048;
+	}
+
+	if (verbose && st->format != miragestream_spill_only)
+		g_printerr("Converting input stream in a single pass\n");
+
+	return st;
+}
+
+gboolean miragestream_is_streamable(miragestream_t* const st) {
+	return st->format != miragestream_spill_only;
+}
+
+/* Returns the output size, or 0 if it is not known before conversion. */
+guint64 miragestream_get_size(miragestream_t* const st) {
+	return st->size;
+}
+
+gint miragestream_convert(miragestream_t* const st, FILE* const out,
+		void (*report_progress)(gint, gint, gint)) {
+	gboolean ok = FALSE;
+
+	st->out = out;
+	st->report_progress = report_progress;
+	st->ret = EX_OK;
+	st->ibuf = g_malloc(MIRAGESTREAM_BUF_SIZE);
+	st->obuf = g_malloc(MIRAGESTREAM_BUF_SIZE);
+
+	if (!quiet && st->size)
+		report_progress(-1, 0, st->size / 2048);
+
+	switch (st->format) {
+		case miragestream_plain:
+		case miragestream_raw:
+			ok = miragestream_convert_plain(st);
+			break;
+		case miragestream_ecm:
+			ok = miragestream_convert_ecm(st);
+			break;
+#ifdef HAVE_ZLIB
+		case miragestream_cso:
+			ok = miragestream_convert_cso(st);
+			break;
+#endif
+		default:
+			st->ret = EX_SOFTWARE;
+	}
+
+	if (ok)
+		ok = miragestream_finish(st);
+
+	if (!quiet && st->size)
+		report_progress(-1, 0, 0);
+
+	if (ok && verbose)
+		g_printerr("%" G_GUINT64_FORMAT " bytes written\n", st->written);
+
+	return ok ? EX_OK : st->ret;
+}
+
+/* libmirage parsers check the file suffix, so the temporary file gets
+ * the one matching the image; the header tells DAA and ISZ... */
+static const gchar* miragestream_head_suffix(miragestream_t* const st) {
+	if (st->head_len >= 4 && !memcmp(st->head, "DAA\0", 4))
+		return ".daa";
+	if (st->head_len >= 4 && !memcmp(st->head, "IsZ!", 4))
+		return ".isz";
+	return "";
+}
+
+/* ...and the trailer NRG and DMG; NULL if not known. */
+static const gchar* miragestream_tail_suffix(const guint8* const tail, const gsize len) {
+	if ((len >= 12 && !memcmp(&tail[len - 12], "NER5", 4))
+			|| (len >= 8 && !memcmp(&tail[len - 8], "NERO", 4)))
+		return ".nrg";
+	if (len >= 512 && !memcmp(&tail[len - 512], "koly", 4))
+		return ".dmg";
+	return NULL;
+}
+
+/* Copies the whole input into a temporary file for libmirage,
+ * up to max_bytes (0 for no limit). The caller removes the file. */
+gchar* miragestream_spill(miragestream_t* const st, const guint64 max_bytes) {
+	const gchar *suffix = miragestream_head_suffix(st);
+	GError *err = NULL;
+	gchar *fn, *tmpl;
+	guint8 *buf;
+	guint8 tail[512];
+	gsize tail_len = 0;
+	guint64 total = 0;
+	gboolean ok = TRUE;
+	FILE *f;
+	gsize n;
+	gint fd;
+
+	tmpl = g_strconcat("mirage2iso-XXXXXX", suffix, NULL);
+	fd = g_file_open_tmp(tmpl, &fn, &err);
+	g_free(tmpl);
+	if (fd == -1) {
+		g_printerr("Unable to create temporary file: %s\n", err->message);
+		g_error_free(err);
+		return NULL;
+	}
+
+	if (!((f = fdopen(fd, "wb")))) {
+		g_printerr("fdopen() failed: %s\n", g_strerror(errno));
+		close(fd);
+		remove(fn);
+		g_free(fn);
+		return NULL;
+	}
+
+	if (verbose)
+		g_printerr("Spilling input stream into '%s'\n", fn);
+
+	buf = g_malloc(MIRAGESTREAM_BUF_SIZE);
+	while (ok && ((n = miragestream_read(st, buf, MIRAGESTREAM_BUF_SIZE)))) {
+		total += n;
+
+		if (max_bytes && total > max_bytes) {
+			g_printerr("Input stream exceeds the spill limit of %" G_GUINT64_FORMAT " MiB\n",
+					max_bytes >> 20);
+			ok = FALSE;
+		} else if (fwrite(buf, 1, n, f) != n) {
+			g_printerr("Writing temporary file failed: %s\n", g_strerror(errno));
+			ok = FALSE;
+		}
+
+		if (n >= sizeof(tail)) {
+			memcpy(tail, &buf[n - sizeof(tail)], sizeof(tail));
+			tail_len = sizeof(tail);
+		} else {
+			const gsize keep = MIN(tail_len, sizeof(tail) - n);
+
+			memmove(tail, &tail[tail_len - keep], keep);
+			memcpy(&tail[keep], buf, n);
+			tail_len = keep + n;
+		}
+	}
+	g_free(buf);
+
+	if (ok && ferror(st->in)) {
+		g_printerr("Reading input failed: %s\n", g_strerror(errno));
+		ok = FALSE;
+	}
+
+	if (fclose(f)) {
+		g_printerr("fclose() failed: %s\n", g_strerror(errno));
+		ok = FALSE;
+	}
+
+	if (!ok) {
+		remove(fn);
+		g_free(fn);
+		return NULL;
+	}
+
+	/* link() rather than rename() not to replace an existing file */
+	if (!*suffix && ((suffix = miragestream_tail_suffix(tail, tail_len)))) {
+		gchar* const nfn = g_strconcat(fn, suffix, NULL);
+
+		if (link(fn, nfn)) {
+			g_printerr("link() failed: %s\n", g_strerror(errno));
+			g_free(nfn);
+		} else {
+			if (remove(fn))
+				g_printerr("remove() failed: %s\n", g_strerror(errno));
+			g_free(fn);
+			fn = nfn;
+		}
+	}
+
+	return fn;
+}
+
+void miragestream_free(miragestream_t* const st) {
+	g_free(st->head);
+	g_free(st->ibuf);
+	g_free(st->obuf);
+	g_free(st->index);
+	g_free(st);
+}
@@ -0,0 +1,23 @@
+/* mirage2iso; single-pass conversion of streamed input
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_STREAM_H
+#define _MIRAGE_STREAM_H 1
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef struct miragestream miragestream_t;
+
+miragestream_t* miragestream_open(FILE* const in, const gint sector_size);
+gboolean miragestream_is_streamable(miragestream_t* const st);
+guint64 miragestream_get_size(miragestream_t* const st);
+gint miragestream_convert(miragestream_t* const st, FILE* const out,
+		void (*report_progress)(gint, gint, gint));
+gchar* miragestream_spill(miragestream_t* const st, const guint64 max_bytes);
+void miragestream_free(miragestream_t* const st);
+
+#endif
@@ -0,0 +1,24 @@
+/* mirage2iso; exit codes
+ * (c) 2009/10 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifndef _MIRAGE_SYSEXITS_H
+#define _MIRAGE_SYSEXITS_H 1
+
+#ifndef NO_SYSEXITS
+#	include <sysexits.h>
+#else
+#	define EX_OK 0
+#	define EX_USAGE 64
+#	define EX_DATAERR 65
+#	define EX_NOINPUT 66
+#	define EX_UNAVAILABLE 69
+#	define EX_SOFTWARE 70
+#	define EX_OSERR 71
+#	define EX_CANTCREAT 73
+#	define EX_IOERR 74
+#	define EX_PROTOCOL 76
+#endif
+
+#endif
@@ -20,9 +20,16 @@
 #else
 #   include <mirage.h>
 #endif
+#include "mirage-check.h"
 #include "mirage-password.h"
+#include "mirage-prefetch.h"
+#include "mirage-probes.h"
+#include "mirage-stats.h"
 #include "mirage-wrapper.h"
 
+/* sectors decoded before each write; matches progress reporting */
+#define MIRAGEWRAP_BATCH 64
+
 extern gboolean quiet;
 extern gboolean verbose;
 
@@ -41,12 +48,14 @@ gchar* miragewrap_password_callback(gpointer user_data) {
 }
 
 gboolean miragewrap_init(void) {
+	miragestats_mark_t mark;
 	GError *err = NULL;
 
 #if !defined(GLIB_VERSION_2_36)
 	g_type_init();
 #endif
 
+	miragestats_begin(&mark);
 	if (!((mirage = g_object_new(MIRAGE_TYPE_CONTEXT, NULL))))
 		return FALSE;
 
@@ -55,6 +64,7 @@ gboolean miragewrap_init(void) {
 		g_error_free(err);
 		return FALSE;
 	}
+	miragestats_end(&mark, miragestats_init, 0, 0);
 
 	mirage_context_set_password_function(mirage, miragewrap_password_callback,
 /* mirage-3.0.5 introduces extra destroy notify for userdata */
@@ -73,6 +83,7 @@ const gchar* miragewrap_get_version(void) {
 gboolean miragewrap_open(const gchar* const fn, const gint session_num) {
 	GError *err = NULL;
 	gchar *filenames[] = { NULL, NULL };
+	miragestats_mark_t mark;
 	gint sessions;
 	gchar *_fn;
 
@@ -84,7 +95,11 @@ gboolean miragewrap_open(const gchar* const fn, const gint session_num) {
 	_fn = g_strdup(fn);
 	filenames[0] = _fn;
 
+	MIRAGE_PROBE1(open__start, fn);
+	miragestats_begin(&mark);
 	disc = mirage_context_load_image(mirage, filenames, &err);
+	miragestats_end(&mark, miragestats_open, 0, 0);
+	MIRAGE_PROBE2(open__end, fn, disc != NULL);
 	if (!disc) {
 		g_printerr("Unable to open input '%s': %s\n", fn, err->message);
 		g_free(_fn);
@@ -127,7 +142,117 @@ gint miragewrap_get_track_count(void) {
 	return tracks;
 }
 
-static MirageTrack *miragewrap_get_track_common(const gint track_num, gint *sstart, gint *len, gint *sectsize) {
+/* Copy kernels, one per sector type and output layout; chosen once per
+ * track, so that copying a sector takes no decisions. */
+typedef gboolean (*miragewrap_copy_func_t)(MirageSector* const sect, guint8* const dst,
+		GError** const err);
+
+static gint miragewrap_sector_format = 2048;
+
+static inline gboolean miragewrap_copy_part(MirageSector* const sect,
+		gboolean (*get)(MirageSector*, const guint8**, gint*, GError**),
+		guint8* const dst, const gint len, GError** const err) {
+	const guint8 *part;
+	gint olen;
+
+	if (!get(sect, &part, &olen, err))
+		return FALSE;
+
+	if (olen != len) {
+		g_set_error(err, MIRAGE_ERROR, MIRAGE_ERROR_SECTOR_ERROR,
+				"data read returned %d bytes while %d was expected", olen, len);
+		return FALSE;
+	}
+
+	memcpy(dst, part, len);
+	return TRUE;
+}
+
+static gboolean miragewrap_copy_data(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_data, dst, 2048, err);
+}
+
+static gboolean miragewrap_copy_audio(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_data, dst, 2352, err);
+}
+
+#if MIRAGE_VERSION_MAJOR >= 3
+/* sectors of unknown type are only available as a whole */
+static gboolean miragewrap_copy_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_sector, dst, 2352, err);
+}
+#endif
+
+static gboolean miragewrap_copy_mode1_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_sync, dst, 12, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_header, &dst[12], 4, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_data, &dst[16], 2048, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_edc_ecc, &dst[2064], 288, err);
+}
+
+static gboolean miragewrap_copy_mode2(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_data, dst, 2336, err);
+}
+
+static gboolean miragewrap_copy_form1(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_subheader, dst, 8, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_data, &dst[8], 2048, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_edc_ecc, &dst[2056], 280, err);
+}
+
+static gboolean miragewrap_copy_form2(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_subheader, dst, 8, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_data, &dst[8], 2324, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_edc_ecc, &dst[2332], 4, err);
+}
+
+/* Form 1 and Form 2 sectors interleave, so sizes are taken as they come */
+static gboolean miragewrap_copy_mixed(MirageSector* const sect, guint8* const dst, GError** const err) {
+	const guint8 *data;
+	gint len;
+
+	if (!miragewrap_copy_part(sect, &mirage_sector_get_subheader, dst, 8, err)
+			|| !mirage_sector_get_data(sect, &data, &len, err))
+		return FALSE;
+
+	if (len != 2048 && len != 2324) {
+		g_set_error(err, MIRAGE_ERROR, MIRAGE_ERROR_SECTOR_ERROR,
+				"data read returned %d bytes while 2048 or 2324 was expected", len);
+		return FALSE;
+	}
+
+	memcpy(&dst[8], data, len);
+	return miragewrap_copy_part(sect, &mirage_sector_get_edc_ecc, &dst[8 + len], 2328 - len, err);
+}
+
+static gboolean miragewrap_copy_sync_header(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_part(sect, &mirage_sector_get_sync, dst, 12, err)
+		&& miragewrap_copy_part(sect, &mirage_sector_get_header, &dst[12], 4, err);
+}
+
+static gboolean miragewrap_copy_mode2_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_sync_header(sect, dst, err) && miragewrap_copy_mode2(sect, &dst[16], err);
+}
+
+static gboolean miragewrap_copy_form1_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_sync_header(sect, dst, err) && miragewrap_copy_form1(sect, &dst[16], err);
+}
+
+static gboolean miragewrap_copy_form2_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_sync_header(sect, dst, err) && miragewrap_copy_form2(sect, &dst[16], err);
+}
+
+static gboolean miragewrap_copy_mixed_raw(MirageSector* const sect, guint8* const dst, GError** const err) {
+	return miragewrap_copy_sync_header(sect, dst, err) && miragewrap_copy_mixed(sect, &dst[16], err);
+}
+
+/* Selects the output layout: 2048 (user data only), 2336 or 2352. */
+void miragewrap_set_sector_format(const gint sector_format) {
+	miragewrap_sector_format = sector_format;
+}
+
+static MirageTrack *miragewrap_get_track_common(const gint track_num, gint *sstart, gint *len,
+		gint *sectsize, miragewrap_copy_func_t *copy, const gchar **cue_mode) {
 	MirageTrack *track = NULL;
 	GError *err = NULL;
 
@@ -145,8 +270,11 @@ static MirageTrack *miragewrap_get_track_common(const gint track_num, gint *ssta
 		*len = mirage_track_layout_get_length(track);
 
 	if (sectsize) {
+		const gboolean raw = miragewrap_sector_format == 2352;
+		miragewrap_copy_func_t kernel = NULL;
+		const gchar *mode = NULL;
 		gint sector_type;
-		const gchar *unsupp_desc;
+		const gchar *desc;
 
 #if MIRAGE_VERSION_MAJOR >= 3
 		sector_type = mirage_track_get_sector_type(track);
@@ -154,73 +282,108 @@ static MirageTrack *miragewrap_get_track_common(const gint track_num, gint *ssta
 		sector_type = mirage_track_get_mode(track);
 #endif
 
-		unsupp_desc = NULL;
+		/* kernel is left NULL for layouts the sector type doesn't fit */
 		switch (sector_type) {
-			/* supported sector types, we set *sectsize and leave unsupp_desc NULL */
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_MODE1:
-			case MIRAGE_SECTOR_MODE2_FORM1:
 #else
 			case MIRAGE_MODE_MODE1:
+#endif
+				desc = "a Mode 1";
+				if (miragewrap_sector_format == 2048)
+					kernel = &miragewrap_copy_data;
+				else if (raw)
+					kernel = &miragewrap_copy_mode1_raw;
+				mode = raw ? "MODE1/2352" : "MODE1/2048";
+				break;
+#if MIRAGE_VERSION_MAJOR >= 3
+			case MIRAGE_SECTOR_MODE2_FORM1:
+#else
 			case MIRAGE_MODE_MODE2_FORM1:
 #endif
-				*sectsize = 2048;
+				desc = "a Mode 2 Form 1";
+				if (miragewrap_sector_format == 2048)
+					kernel = &miragewrap_copy_data;
+				else
+					kernel = raw ? &miragewrap_copy_form1_raw : &miragewrap_copy_form1;
 				break;
-			/* unsupported sector types, we leave *sectsize unmodified and set unsupp_desc */
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_MODE0:
 #else
 			case MIRAGE_MODE_MODE0:
 #endif
-				unsupp_desc = "a Mode 0";
+				desc = "a Mode 0";
 				break;
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_AUDIO:
 #else
 			case MIRAGE_MODE_AUDIO:
 #endif
-				unsupp_desc = "an audio";
+				desc = "an audio";
+				if (raw)
+					kernel = &miragewrap_copy_audio;
+				mode = "AUDIO";
 				break;
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_MODE2:
 #else
 			case MIRAGE_MODE_MODE2:
 #endif
-				unsupp_desc = "a Mode 2";
+				desc = "a Mode 2";
+				if (miragewrap_sector_format != 2048)
+					kernel = raw ? &miragewrap_copy_mode2_raw : &miragewrap_copy_mode2;
 				break;
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_MODE2_FORM2:
 #else
 			case MIRAGE_MODE_MODE2_FORM2:
 #endif
-				unsupp_desc = "a Mode 2 Form 2";
+				desc = "a Mode 2 Form 2";
+				if (miragewrap_sector_format != 2048)
+					kernel = raw ? &miragewrap_copy_form2_raw : &miragewrap_copy_form2;
 				break;
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_MODE2_MIXED:
 #else
 			case MIRAGE_MODE_MODE2_MIXED:
 #endif
-				unsupp_desc = "a mixed Mode 2";
+				desc = "a mixed Mode 2";
+				if (miragewrap_sector_format != 2048)
+					kernel = raw ? &miragewrap_copy_mixed_raw : &miragewrap_copy_mixed;
 				break;
 #if MIRAGE_VERSION_MAJOR >= 3
 			case MIRAGE_SECTOR_RAW:
-				unsupp_desc = "a raw";
+				desc = "a raw";
+				/* the mode is not known; written as is, described as Mode 2 */
+				if (raw)
+					kernel = &miragewrap_copy_raw;
 				break;
 			case MIRAGE_SECTOR_RAW_SCRAMBLED:
-				unsupp_desc = "a scrambled raw";
+				desc = "a scrambled raw";
 				break;
 #endif
 			/* unknown sector type, report it even if non-verbose and leave now */
 			default:
 				g_printerr("Unknown track sector type / mode (%d) for track %d (newer libmirage?)\n", sector_type, track_num);
+				g_object_unref(track);
 				return NULL;
 		}
 
-		if (unsupp_desc) { /* got unsupported sector type */
+		MIRAGE_PROBE3(track__check, track_num, sector_type, kernel != NULL);
+
+		if (!kernel) { /* got unsupported sector type */
 			if (verbose)
-				g_printerr("Track %d is %s track (unsupported)\n", track_num, unsupp_desc);
+				g_printerr("Track %d is %s track (unsupported with %d-byte sectors)\n",
+						track_num, desc, miragewrap_sector_format);
+			g_object_unref(track);
 			return NULL;
 		}
+
+		*sectsize = miragewrap_sector_format;
+		if (copy)
+			*copy = kernel;
+		if (cue_mode)
+			*cue_mode = mode ? mode : raw ? "MODE2/2352" : "MODE2/2336";
 	}
 
 	return track;
@@ -235,7 +398,7 @@ gsize miragewrap_get_track_size(const gint track_num) {
 		return 0;
 	}
 
-	track = miragewrap_get_track_common(track_num, &sstart, &len, &expssize);
+	track = miragewrap_get_track_common(track_num, &sstart, &len, &expssize, NULL, NULL);
 	if (!track)
 		return 0;
 
@@ -244,88 +407,287 @@ gsize miragewrap_get_track_size(const gint track_num) {
 	return expssize * (len-sstart);
 }
 
-gboolean miragewrap_output_track(const gint track_num, FILE* const f,
+/* Returns the CUE sheet mode of the track, its number and pregap length,
+ * or NULL if the track can't be output with the selected layout. */
+const gchar* miragewrap_get_track_cue_mode(const gint track_num, gint* const number, gint* const pregap) {
+	const gchar *mode;
+	MirageTrack *track;
+	gint sectsize;
+
+	if (!session) {
+		g_printerr("miragewrap_get_track_cue_mode() has to be called after miragewrap_open()\n");
+		return NULL;
+	}
+
+	track = miragewrap_get_track_common(track_num, pregap, NULL, &sectsize, NULL, &mode);
+	if (!track)
+		return NULL;
+
+	*number = mirage_track_layout_get_track_number(track);
+	g_object_unref(track);
+	return mode;
+}
+
+#if MIRAGE_VERSION_MAJOR >= 3
+/* Reassembles the raw sector for --check-edc. Sectors whose EDC/ECC
+ * was not stored in the image would be checked against values libmirage
+ * computed itself, so they are skipped. */
+static void miragewrap_check_sector(MirageSector* const sect, const gint address, guint8* const data) {
+	gboolean (* const getters[])(MirageSector*, const guint8**, gint*, GError**) = {
+		mirage_sector_get_sync,
+		mirage_sector_get_header,
+		mirage_sector_get_subheader,
+		mirage_sector_get_data,
+		mirage_sector_get_edc_ecc
+	};
+	const MirageSectorType type = mirage_sector_get_sector_type(sect);
+	guint8 *raw;
+	gint i, pos;
+
+	if (!(mirage_sector_get_valid_data(sect) & MIRAGE_VALID_EDC_ECC)) {
+		miragecheck_skip();
+		return;
+	}
+
+	raw = miragecheck_slot();
+	for (i = 0, pos = 0; i < (gint) G_N_ELEMENTS(getters); i++) {
+		const guint8 *part;
+		gint len;
+
+		/* Mode 1 has no subheader */
+		if (type == MIRAGE_SECTOR_MODE1 && getters[i] == mirage_sector_get_subheader)
+			continue;
+		if (!getters[i](sect, &part, &len, NULL) || pos + len > 2352) {
+			miragecheck_skip();
+			return;
+		}
+
+		memcpy(&raw[pos], part, len);
+		pos += len;
+	}
+
+	miragecheck_commit(address,
+			type == MIRAGE_SECTOR_MODE1 ? mirageecc_mode1 : mirageecc_mode2_form1, data);
+}
+#endif
+
+/* Decodes count sectors starting at (absolute) sector start into buf,
+ * passing them to --check-edc if check is set. */
+static gboolean miragewrap_decode(MirageTrack* const track, const gint start, const gint count,
+		const gint sectsize, miragewrap_copy_func_t copy, guint8* const buf, const gboolean check,
 		void (*report_progress)(gint, gint, gint)) {
 	GError *err = NULL;
+	miragestats_mark_t mark;
+	gint i;
+
+	MIRAGE_PROBE2(decode__start, start, count);
+	miragestats_begin(&mark);
+	for (i = 0; i < count; i++) {
+		MirageSector *sect;
+
+		sect = mirage_track_get_sector(track, start + i, FALSE, &err);
+		if (!sect) {
+			if (report_progress && !quiet)
+				report_progress(-1, 0, 0);
+			g_printerr("Unable to get sector %d: %s\n", start + i, err->message);
+			g_error_free(err);
+			return FALSE;
+		}
+
+		if (!copy(sect, &buf[i * sectsize], &err)) {
+			if (report_progress && !quiet)
+				report_progress(-1, 0, 0);
+			g_printerr("Unable to read sector %d: %s\n", start + i, err->message);
+			g_object_unref(sect);
+			g_error_free(err);
+			return FALSE;
+		}
+
+#if MIRAGE_VERSION_MAJOR >= 3
+		if (check)
+			miragewrap_check_sector(sect, start + i, &buf[i * sectsize]);
+#endif
+		g_object_unref(sect);
+	}
+	miragestats_end(&mark, miragestats_decode, count, (guint64) count * sectsize);
+	MIRAGE_PROBE2(decode__end, start, count);
+
+	return TRUE;
+}
+
+/* how far ahead of the decoder the input is read, in sectors */
+static gint miragewrap_prefetch_sectors = 0;
+
+void miragewrap_set_prefetch(const gint mib) {
+	/* reading further ahead than G_MAXINT sectors is pointless anyway */
+	miragewrap_prefetch_sectors = MIN(mib, G_MAXINT / (1024 * 1024 / 2352)) * (1024 * 1024 / 2352);
+}
+
+#if MIRAGE_VERSION_MAJOR >= 3
+/* Starts reading ahead the files backing the track fragments. */
+static mirageprefetch_t* miragewrap_prefetch_track(MirageTrack* const track, const gint first) {
+	mirageprefetch_t *pf;
+	const gint fragments = mirage_track_get_number_of_fragments(track);
+	gint i;
+
+	if (!miragewrap_prefetch_sectors)
+		return NULL;
+
+	pf = mirageprefetch_new(miragewrap_prefetch_sectors);
+	for (i = 0; i < fragments; i++) {
+		MirageFragment* const frag = mirage_track_get_fragment_by_index(track, i, NULL);
+		const gchar *fn;
+		gint size;
+
+		if (!frag)
+			continue;
+
+		/* NULL filename means a null fragment (e.g. pregap) */
+		fn = mirage_fragment_main_data_get_filename(frag);
+		size = mirage_fragment_main_data_get_size(frag);
+		if (mirage_fragment_subchannel_data_get_format(frag) & MIRAGE_SUBCHANNEL_DATA_FORMAT_INTERNAL)
+			size += mirage_fragment_subchannel_data_get_size(frag);
+
+		if (fn && size)
+			mirageprefetch_add(pf, mirage_fragment_get_address(frag),
+					mirage_fragment_get_length(frag), fn,
+					mirage_fragment_main_data_get_offset(frag), size);
+		g_object_unref(frag);
+	}
+
+	if (!mirageprefetch_start(pf, first)) {
+		mirageprefetch_free(pf);
+		return NULL;
+	}
+	return pf;
+}
+#endif
+
+/* Decodes the track and passes it to write in batches. */
+gboolean miragewrap_output_track_to(const gint track_num, miragewrap_write_func_t write,
+		gpointer user_data, void (*report_progress)(gint, gint, gint)) {
 	gint sstart, len, bufsize;
+	miragewrap_copy_func_t copy;
 	MirageTrack *track;
+	mirageprefetch_t *pf = NULL;
 
 	if (!session) {
-		g_printerr("miragewrap_output_track() has to be called after miragewrap_open()\n");
+		g_printerr("miragewrap_output_track_to() has to be called after miragewrap_open()\n");
 		return 0;
 	}
 
-	track = miragewrap_get_track_common(track_num, &sstart, &len, &bufsize);
+	track = miragewrap_get_track_common(track_num, &sstart, &len, &bufsize, &copy, NULL);
 	if (!track)
 		return FALSE;
 
-	{
-		gint i, olen;
-		const guint8* buf;
+#if MIRAGE_VERSION_MAJOR >= 3
+	pf = miragewrap_prefetch_track(track, sstart);
+#else
+	if (miragecheck_enabled && !quiet)
+		g_printerr("--check-edc needs libmirage 3, sectors will not be verified\n");
+#endif
 
-		MirageSector *sect;
+	{
+		guint8* const buf = g_malloc(MIRAGEWRAP_BATCH * bufsize);
+		gint i, n;
 
 		len--; /* well, now it's rather 'last' */
 		if (!quiet)
 			report_progress(-1, 0, len);
-		for (i = sstart; i <= len; i++) {
-			if (!quiet && !(i % 64))
+		for (i = sstart; i <= len; i += n) {
+			miragestats_mark_t mark;
+
+			n = MIN(MIRAGEWRAP_BATCH, len - i + 1);
+			if (pf)
+				mirageprefetch_advance(pf, i + n);
+			MIRAGE_PROBE3(progress, track_num, i - sstart, len - sstart + 1);
+			if (!quiet)
 				report_progress(track_num, i, len);
 
-			sect = mirage_track_get_sector(track, i, FALSE, &err);
-			if (!sect) {
-				if (!quiet)
-					report_progress(-1, 0, 0);
-				g_printerr("Unable to get sector %d: %s\n", i, err->message);
-				g_object_unref(track);
-				g_error_free(err);
-				return FALSE;
-			}
-
-			if (!mirage_sector_get_data(sect, &buf, &olen, &err)) {
-				if (!quiet)
-					report_progress(-1, 0, 0);
-				g_printerr("Unable to read sector %d: %s\n", i, err->message);
-				g_object_unref(sect);
+			/* repair writes back user data, so only 2048-byte output is checked */
+			if (!miragewrap_decode(track, i, n, bufsize, copy, buf,
+						miragecheck_enabled && bufsize == 2048, report_progress)) {
+				g_free(buf);
+				if (pf)
+					mirageprefetch_free(pf);
 				g_object_unref(track);
-				g_error_free(err);
 				return FALSE;
 			}
 
-			if (olen != bufsize) {
+			MIRAGE_PROBE3(write__submit, i, n, n * bufsize);
+			miragestats_begin(&mark);
+			if (!write(buf, (gsize) n * bufsize, user_data)) {
+				MIRAGE_PROBE3(write__complete, i, n, -1);
 				if (!quiet)
 					report_progress(-1, 0, 0);
-				g_printerr("Data read returned %d bytes while %d was expected\n",
-						olen, bufsize);
-				g_object_unref(sect);
+				g_printerr("Write failed on sectors %d-%d: %s\n", i, i + n - 1,
+						g_strerror(errno));
+				g_free(buf);
+				if (pf)
+					mirageprefetch_free(pf);
 				g_object_unref(track);
 				return FALSE;
 			}
-
-			if (fwrite(buf, olen, 1, f) != 1) {
-				if (!quiet)
-					report_progress(-1, 0, 0);
-				g_printerr("Write failed on sector %d%s%s", i,
-						ferror(f) ? ": " : " but error flag not set\n",
-						ferror(f) ? g_strerror(errno) : "");
-				g_object_unref(sect);
-				g_object_unref(track);
-				return FALSE;
-			}
-
-			g_object_unref(sect);
+			miragestats_end(&mark, miragestats_write, n, (guint64) n * bufsize);
+			MIRAGE_PROBE3(write__complete, i, n, n * bufsize);
 		}
 
 		if (!quiet) {
 			report_progress(track_num, len, len);
 			report_progress(-1, 0, 0);
 		}
+		g_free(buf);
 	}
 
+	if (pf)
+		mirageprefetch_free(pf);
 	g_object_unref(track);
 	return TRUE;
 }
 
+static gboolean miragewrap_stdio_write(const guint8* const buf, const gsize len, gpointer user_data) {
+	FILE* const f = user_data;
+
+	if (fwrite(buf, 1, len, f) == len)
+		return TRUE;
+
+	if (!ferror(f))
+		errno = EIO;
+	return FALSE;
+}
+
+gboolean miragewrap_output_track(const gint track_num, FILE* const f,
+		void (*report_progress)(gint, gint, gint)) {
+	return miragewrap_output_track_to(track_num, &miragewrap_stdio_write, f, report_progress);
+}
+
+gboolean miragewrap_read_sectors(const gint track_num, const gint start, const gint count,
+		guint8* const buf) {
+	gint sstart, len, sectsize;
+	miragewrap_copy_func_t copy;
+	MirageTrack *track;
+	gboolean ret;
+
+	if (!session) {
+		g_printerr("miragewrap_read_sectors() has to be called after miragewrap_open()\n");
+		return FALSE;
+	}
+
+	track = miragewrap_get_track_common(track_num, &sstart, &len, &sectsize, &copy, NULL);
+	if (!track)
+		return FALSE;
+
+	if (start < 0 || count < 0 || start + count > len - sstart) {
+		g_printerr("Sectors %d-%d out of track %d bounds\n", start, start + count - 1, track_num);
+		g_object_unref(track);
+		return FALSE;
+	}
+
+	ret = miragewrap_decode(track, sstart + start, count, sectsize, copy, buf, FALSE, NULL);
+	g_object_unref(track);
+	return ret;
+}
+
 void miragewrap_free(void) {
 	GError *err;
 
@@ -8,13 +8,23 @@
 
 #include <glib.h>
 
+typedef gboolean (*miragewrap_write_func_t)(const guint8* const buf, const gsize len,
+		gpointer user_data);
+
 gboolean miragewrap_init(void);
 const gchar* miragewrap_get_version(void);
 gboolean miragewrap_open(const gchar* const fn, const gint session_num);
 gint miragewrap_get_track_count(void);
+void miragewrap_set_sector_format(const gint sector_format);
+void miragewrap_set_prefetch(const gint mib);
 gsize miragewrap_get_track_size(const gint track_num);
+const gchar* miragewrap_get_track_cue_mode(const gint track_num, gint* const number, gint* const pregap);
 gboolean miragewrap_output_track(const gint track_num, FILE* const f,
 		void (*report_progress)(gint, gint, gint));
+gboolean miragewrap_output_track_to(const gint track_num, miragewrap_write_func_t write,
+		gpointer user_data, void (*report_progress)(gint, gint, gint));
+gboolean miragewrap_read_sectors(const gint track_num, const gint start, const gint count,
+		guint8* const buf);
 void miragewrap_free(void);
 
 #endif
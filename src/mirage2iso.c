@@ -16,26 +16,33 @@
 #	include <fcntl.h>
 #endif
 
-#ifndef NO_SYSEXITS
-#	include <sysexits.h>
-#else
-#	define EX_OK 0
-#	define EX_USAGE 64
-#	define EX_DATAERR 65
-#	define EX_NOINPUT 66
-#	define EX_SOFTWARE 70
-#	define EX_OSERR 71
-#	define EX_CANTCREAT 73
-#	define EX_IOERR 74
-#endif
-
 #include <glib.h>
 
+#ifdef HAVE_FUSE
+#	include "mirage-fuse.h"
+#endif
+#include "mirage-cache.h"
+#include "mirage-dedup.h"
+#include "mirage-fanout.h"
+#include "mirage-iso9660.h"
+#include "mirage-nbd.h"
 #include "mirage-password.h"
+#include "mirage-check.h"
+#include "mirage-probes.h"
+#include "mirage-server.h"
+#include "mirage-split.h"
+#include "mirage-stats.h"
+#include "mirage-stream.h"
+#include "mirage-sysexits.h"
 #include "mirage-wrapper.h"
 
 gboolean quiet = FALSE;
 gboolean verbose = FALSE;
+/* --store, --sector-format, multiple --output and --split-size, for convert_image() */
+static gchar* store_path = NULL;
+static gint sector_format = 0;
+static gchar** output_paths = NULL;
+static guint64 split_size = 0;
 
 static void version(const gboolean mirage) {
 	const gchar* const ver = mirage ? miragewrap_get_version() : NULL;
@@ -49,7 +56,8 @@ static gboolean common_posix_filesetup(const int fd, const gsize size) {
 #endif
 
 #ifdef HAVE_POSIX_FALLOCATE
-	if ((errno = posix_fallocate(fd, 0, size))) {
+	/* size is not known in advance for streamed input */
+	if (size && (errno = posix_fallocate(fd, 0, size))) {
 		g_printerr("posix_fallocate() failed: %s", g_strerror(errno));
 
 		/* If we can't create file large enough, return false.
@@ -100,6 +108,91 @@ static void report_progress(gint track_num, gint sect, gint sect_max) {
 				vlen, sect, sect_max, 100 * sect / sect_max);
 }
 
+/* Puts the track into the chunk store and writes its recipe to fn. */
+static gint store_track(const gchar* const fn, const gint track_num) {
+	miragededup_t *dd;
+	gint ret;
+
+	if (!((dd = miragededup_new(store_path))))
+		return EX_CANTCREAT;
+
+	if (verbose)
+		g_printerr("Storing track %d in '%s'\n", track_num, store_path);
+
+	if (!miragewrap_output_track_to(track_num, &miragededup_write, dd, &report_progress))
+		ret = EX_IOERR;
+	else
+		ret = miragededup_finish(dd, fn);
+
+	miragededup_free(dd);
+	return ret;
+}
+
+/* Writes the track into --split-size parts of fn as it is decoded. */
+static gint output_track_split(const gchar* const fn, const gint track_num, const gsize size) {
+	miragesplit_t *sp;
+	gint ret;
+
+	if (!((sp = miragesplit_new(fn, size, split_size, &stdio_open))))
+		return EX_CANTCREAT;
+
+	if (verbose)
+		g_printerr("Splitting track %d into parts of %" G_GUINT64_FORMAT " bytes\n", track_num, split_size);
+
+	if (!miragewrap_output_track_to(track_num, &miragesplit_write, sp, &report_progress))
+		ret = EX_IOERR;
+	else
+		ret = miragesplit_finish(sp);
+
+	miragesplit_free(sp);
+	return ret;
+}
+
+/* Writes the track into all --output files, decoding it only once. */
+static gint output_track_multi(const gint track_num, const gsize size) {
+	miragefanout_t* const fo = miragefanout_new();
+	gint i, ret = EX_OK;
+
+	for (i = 0; output_paths[i]; i++) {
+		const gchar* const fn = strcmp(output_paths[i], "-") ? output_paths[i] : NULL;
+		FILE *f = NULL;
+
+		if (!fn)
+			f = stdout;
+		else if (((ret = stdio_open(fn, size, &f)))) {
+			if (f) {
+				if (fclose(f))
+					g_printerr("fclose() failed: %s", g_strerror(errno));
+				if (remove(fn))
+					g_printerr("remove() failed: %s", g_strerror(errno));
+			}
+			break;
+		}
+
+		miragefanout_add(fo, f, fn);
+		if (verbose)
+			g_printerr("Output file '%s' open for track %d\n", fn ? fn : "-", track_num);
+	}
+
+	if (ret == EX_OK) {
+		if (!miragewrap_output_track_to(track_num, &miragefanout_write, fo, &report_progress))
+			ret = EX_IOERR;
+		else
+			ret = miragefanout_finish(fo);
+	}
+	miragefanout_free(fo);
+
+	/* don't leave the preallocated files behind */
+	if (output_paths[i]) {
+		while (--i >= 0) {
+			if (strcmp(output_paths[i], "-") && remove(output_paths[i]))
+				g_printerr("remove() failed: %s", g_strerror(errno));
+		}
+	}
+
+	return ret;
+}
+
 static gint output_track(const gchar* const fn, const gint track_num) {
 	const gboolean use_stdout = !fn;
 
@@ -109,6 +202,14 @@ static gint output_track(const gchar* const fn, const gint track_num) {
 
 	if (size == 0)
 		return EX_DATAERR;
+	MIRAGE_PROBE1(track__select, track_num);
+
+	if (store_path)
+		return store_track(fn, track_num);
+	if (split_size)
+		return output_track_split(fn, track_num, size);
+	if (output_paths && output_paths[1])
+		return output_track_multi(track_num, size);
 
 	if (use_stdout) {
 		f = stdout;
@@ -148,6 +249,414 @@ static gint output_track(const gchar* const fn, const gint track_num) {
 	return EX_OK;
 }
 
+static void frames_to_msf(GString* const str, const gchar* const prefix, const guint64 frames) {
+	g_string_append_printf(str, "%s %02d:%02d:%02d\n", prefix,
+			(gint) (frames / (60 * 75)), (gint) (frames / 75 % 60), (gint) (frames % 75));
+}
+
+/* Writes all tracks supported with --sector-format into a single .bin,
+ * and a .cue describing them next to it. */
+static gint output_bin(const gchar* const fn, const gint tcount) {
+	gsize* const sizes = g_new(gsize, tcount);
+	GString* const cue = g_string_new(NULL);
+	gchar *base, *cuefn;
+	guint64 size = 0, offset = 0;
+	GError *err = NULL;
+	FILE *f = NULL;
+	gint i, ret;
+
+	for (i = 0; i < tcount; i++)
+		size += ((sizes[i] = miragewrap_get_track_size(i)));
+
+	if (!size) {
+		g_printerr("No track found that can be output with %d-byte sectors\n", sector_format);
+		g_string_free(cue, TRUE);
+		g_free(sizes);
+		return EX_DATAERR;
+	}
+
+	if (((ret = stdio_open(fn, size, &f)))) {
+		if (f && fclose(f))
+			g_printerr("fclose() failed: %s", g_strerror(errno));
+		g_string_free(cue, TRUE);
+		g_free(sizes);
+		return ret;
+	}
+
+	base = g_path_get_basename(fn);
+	g_string_append_printf(cue, "FILE \"%s\" BINARY\n", base);
+	g_free(base);
+
+	for (i = 0; ret == EX_OK && i < tcount; i++) {
+		const gchar *mode;
+		gint number, pregap;
+
+		if (!sizes[i] || !((mode = miragewrap_get_track_cue_mode(i, &number, &pregap))))
+			continue;
+
+		MIRAGE_PROBE1(track__select, i);
+		g_string_append_printf(cue, "  TRACK %02d %s\n", number, mode);
+		/* pregaps are not stored; the first one is implied */
+		if (offset && pregap)
+			frames_to_msf(cue, "    PREGAP", pregap);
+		frames_to_msf(cue, "    INDEX 01", offset / sector_format);
+
+		if (!miragewrap_output_track(i, f, &report_progress))
+			ret = EX_IOERR;
+		offset += sizes[i];
+	}
+
+	if (fclose(f)) {
+		g_printerr("fclose() failed: %s", g_strerror(errno));
+		if (ret == EX_OK)
+			ret = EX_IOERR;
+	}
+
+	if (ret == EX_OK) {
+		const gchar* const ext = strrchr(fn, '.');
+
+		/* image.bin -> image.cue */
+		if (ext && !strcmp(ext, ".bin"))
+			cuefn = g_strdup_printf("%.*s.cue", (gint) (ext - fn), fn);
+		else
+			cuefn = g_strdup_printf("%s.cue", fn);
+
+		if (!g_file_set_contents(cuefn, cue->str, cue->len, &err)) {
+			g_printerr("Unable to write CUE sheet: %s\n", err->message);
+			g_error_free(err);
+			ret = EX_CANTCREAT;
+		} else if (verbose)
+			g_printerr("CUE sheet written to '%s'\n", cuefn);
+		g_free(cuefn);
+	}
+
+	g_string_free(cue, TRUE);
+	g_free(sizes);
+	return ret;
+}
+
+static gint convert_image(const gchar* const in, const gchar* const out, const gint session_num) {
+	gint tcount, i;
+	gint ret = !EX_OK;
+
+	MIRAGE_PROBE2(convert__start, in, out);
+	if (!miragewrap_open(in, session_num)) {
+		MIRAGE_PROBE1(convert__end, EX_NOINPUT);
+		return EX_NOINPUT;
+	}
+	if (verbose)
+		g_printerr("Input file '%s' open\n", in);
+
+	tcount = miragewrap_get_track_count();
+	if (sector_format > 2048) {
+		ret = output_bin(out, tcount);
+		MIRAGE_PROBE1(convert__end, ret);
+		return ret;
+	}
+
+	if (tcount > 1 && !quiet)
+		g_printerr("NOTE: input session contains %d tracks; mirage2iso will read only the first usable one\n", tcount);
+
+	for (i = 0; ret != EX_OK && i < tcount; i++) {
+		ret = output_track(out, i);
+
+		if (ret != EX_OK && ret != EX_DATAERR) {
+			MIRAGE_PROBE1(convert__end, ret);
+			return ret;
+		}
+	}
+
+	if (ret != EX_OK) /* no valid track found */
+		g_printerr("No supported track found (audio CD?)\n");
+	else if (verbose)
+		g_printerr("Done\n");
+
+	MIRAGE_PROBE1(convert__end, EX_OK);
+	return EX_OK;
+}
+
+/* Converts an image read from stdin in a single pass, or spills it
+ * into a temporary file if the format needs random access. */
+static gint convert_stream(const gchar* const out, const gint session_num,
+		const gint sector_size, const gint spill_mib) {
+	miragestream_t *st;
+	FILE *f = NULL;
+	gint ret;
+
+	if (!((st = miragestream_open(stdin, sector_size))))
+		return EX_IOERR;
+
+	if (!miragestream_is_streamable(st)) {
+		gchar* const fn = miragestream_spill(st, (guint64) spill_mib << 20);
+
+		miragestream_free(st);
+		if (!fn)
+			return EX_CANTCREAT;
+
+		if (!miragewrap_init())
+			ret = EX_SOFTWARE;
+		else {
+			if (verbose)
+				version(TRUE);
+			ret = convert_image(fn, out, session_num);
+			miragewrap_free();
+		}
+
+		if (remove(fn))
+			g_printerr("remove() failed: %s", g_strerror(errno));
+		g_free(fn);
+		return ret;
+	}
+
+	if (!out) {
+		f = stdout;
+
+		if (verbose)
+			g_printerr("Using standard output stream\n");
+	} else if (((ret = stdio_open(out, miragestream_get_size(st), &f)))) {
+		if (f) {
+			if (fclose(f))
+				g_printerr("fclose() failed: %s", g_strerror(errno));
+			if (remove(out))
+				g_printerr("remove() failed: %s", g_strerror(errno));
+		}
+
+		miragestream_free(st);
+		return ret;
+	}
+
+	ret = miragestream_convert(st, f, &report_progress);
+
+	if (out && fclose(f)) {
+		g_printerr("fclose() failed: %s", g_strerror(errno));
+		if (ret == EX_OK)
+			ret = EX_IOERR;
+	}
+
+	miragestream_free(st);
+	return ret;
+}
+
+/* Reassembles an image put into the chunk store with --store. */
+static gint restore_image(const gchar* const in, const gchar* const out) {
+	miragededup_recipe_t *r;
+	FILE *f = NULL;
+	gint ret;
+
+	if (!((r = miragededup_recipe_open(in))))
+		return EX_NOINPUT;
+
+	if (!out)
+		f = stdout;
+	else if (((ret = stdio_open(out, miragededup_recipe_get_size(r), &f)))) {
+		if (f && fclose(f))
+			g_printerr("fclose() failed: %s", g_strerror(errno));
+		miragededup_recipe_free(r);
+		return ret;
+	}
+
+	ret = miragededup_restore(r, store_path, f, &report_progress);
+
+	if (out && fclose(f)) {
+		g_printerr("fclose() failed: %s", g_strerror(errno));
+		if (ret == EX_OK)
+			ret = EX_IOERR;
+	}
+
+	miragededup_recipe_free(r);
+	return ret;
+}
+
+static gint find_track(void) {
+	const gint tcount = miragewrap_get_track_count();
+	gint i;
+
+	for (i = 0; i < tcount; i++) {
+		if (miragewrap_get_track_size(i) > 0) {
+			MIRAGE_PROBE1(track__select, i);
+			return i;
+		}
+	}
+
+	g_printerr("No supported track found (audio CD?)\n");
+	return -1;
+}
+
+/* Opens the image for --mount, --nbd-serve, --extract and --ls. */
+static gint open_image(const gchar* const in, const gint session_num, gint* const track_num) {
+	if (!miragewrap_init())
+		return EX_SOFTWARE;
+
+	if (verbose)
+		version(TRUE);
+
+	if (!miragewrap_open(in, session_num))
+		return EX_NOINPUT;
+
+	if (((*track_num = find_track())) == -1)
+		return EX_DATAERR;
+
+	return EX_OK;
+}
+
+/* Serves the first usable track through --mount or --nbd-serve. */
+static gint export_image(const gchar* const in, const gchar* const target,
+		const gint session_num, const gboolean nbd, const gint cache_mib) {
+	gchar *base, *ext, *name;
+	gint track_num, ret;
+
+	if (((ret = open_image(in, session_num, &track_num))) != EX_OK) {
+		miragewrap_free();
+		return ret;
+	}
+
+	/* image.daa -> image.iso */
+	base = g_path_get_basename(in);
+	if (((ext = strrchr(base, '.'))) && ext != base)
+		*ext = 0;
+	name = g_strdup_printf("%s.iso", base);
+	g_free(base);
+
+	if (nbd)
+		ret = miragenbd_serve(target, name, track_num, (gsize) cache_mib << 20);
+	else {
+#ifdef HAVE_FUSE
+		ret = miragefuse_mount(target, name, track_num, (gsize) cache_mib << 20);
+#else
+		g_printerr("mirage2iso was built without FUSE support\n");
+		ret = EX_USAGE;
+#endif
+	}
+
+	g_free(name);
+	miragewrap_free();
+	return ret;
+}
+
+/* Handles --ls (path == NULL) and --extract, reading only the sectors needed. */
+static gint browse_image(const gchar* const in, const gchar* const path, const gchar* const fn,
+		const gint session_num, const gint cache_mib) {
+	miragecache_t *cache;
+	mirageiso_t *iso;
+	gint track_num, ret;
+
+	if (((ret = open_image(in, session_num, &track_num))) != EX_OK) {
+		miragewrap_free();
+		return ret;
+	}
+
+	if (!((cache = miragecache_new(track_num, (gsize) cache_mib << 20)))) {
+		miragewrap_free();
+		return EX_DATAERR;
+	}
+
+	if (!((iso = mirageiso_open(cache))))
+		ret = EX_DATAERR;
+	else if (!path)
+		ret = mirageiso_list(iso, stdout) ? EX_OK : EX_DATAERR;
+	else {
+		const gint64 size = mirageiso_stat(iso, path);
+		FILE *f = NULL;
+
+		if (size == -1)
+			ret = EX_NOINPUT;
+		else if (!fn) {
+			if (verbose)
+				g_printerr("Extracting '%s' to standard output\n", path);
+			ret = mirageiso_extract(iso, path, stdout) ? EX_OK : EX_IOERR;
+		} else if (((ret = stdio_open(fn, size, &f))) == EX_OK) {
+			if (verbose)
+				g_printerr("Extracting '%s' to '%s'\n", path, fn);
+			ret = mirageiso_extract(iso, path, f) ? EX_OK : EX_IOERR;
+		}
+
+		if (f && fclose(f)) {
+			g_printerr("fclose() failed: %s", g_strerror(errno));
+			ret = EX_IOERR;
+		}
+	}
+
+	if (iso)
+		mirageiso_free(iso);
+	miragecache_free(cache);
+	miragewrap_free();
+	return ret;
+}
+
+static gint cache_size = 64;
+static gchar* connect_path = NULL;
+static gchar* extract_path = NULL;
+static gint max_jobs = 0;
+static gboolean want_ls = FALSE;
+static gboolean want_mount = FALSE;
+static gchar* nbd_addr = NULL;
+static gint prefetch_size = 32;
+static gboolean want_restore = FALSE;
+static gint sector_size = 0;
+static gchar* serve_path = NULL;
+static gint spill_size = 4096;
+
+static gboolean parse_stats(const gchar* const option_name, const gchar* const value,
+		gpointer data, GError** const err) {
+	if (value && strcmp(value, "text") && strcmp(value, "json")) {
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				"%s takes either 'text' or 'json'", option_name);
+		return FALSE;
+	}
+
+	miragestats_enable(value && !strcmp(value, "json"));
+	return TRUE;
+}
+
+static gboolean parse_split_size(const gchar* const option_name, const gchar* const value,
+		gpointer data, GError** const err) {
+	const gchar* const units = "KMGT";
+	const gchar *unit;
+	gchar *end;
+	gint shift = 0;
+
+	/* g_ascii_strtoull() skips spaces and takes '-1' for G_MAXUINT64 */
+	split_size = 0;
+	if (g_ascii_isdigit(*value)) {
+		errno = 0;
+		split_size = g_ascii_strtoull(value, &end, 10);
+
+		if (*end && ((unit = strchr(units, g_ascii_toupper(*end)))) && !end[1])
+			shift = 10 * (unit - units + 1);
+		else if (*end)
+			split_size = 0;
+
+		if (errno || split_size > G_MAXUINT64 >> shift)
+			split_size = 0;
+		split_size <<= shift;
+	}
+
+	if (!split_size) {
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				"%s takes a size in bytes, optionally followed by K, M, G or T", option_name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean parse_check_edc(const gchar* const option_name, const gchar* const value,
+		gpointer data, GError** const err) {
+	if (!value)
+		miragecheck_enable(miragecheck_edc);
+	else if (!strcmp(value, "ecc"))
+		miragecheck_enable(miragecheck_ecc);
+	else if (!strcmp(value, "repair"))
+		miragecheck_enable(miragecheck_repair);
+	else {
+		g_set_error(err, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				"%s takes either 'ecc' or 'repair'", option_name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
 int main(int argc, char* argv[]) {
 	gint session_num = -1;
 	gboolean force = FALSE;
@@ -157,14 +666,32 @@ int main(int argc, char* argv[]) {
 	gchar *passbuf = NULL;
 
 	GOptionEntry opts[] = {
+		{ "cache-size", 0, 0, G_OPTION_ARG_INT, &cache_size, "Decoded block cache size for --mount, --nbd-serve, --extract and --ls, in MiB (default: 64)", "MIB" },
+		{ "check-edc", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer) parse_check_edc, "Verify EDC (and with 'ecc', ECC) of raw sectors and report bad ones; 'repair' corrects them using ECC", "ecc|repair" },
+		{ "connect", 0, 0, G_OPTION_ARG_FILENAME, &connect_path, "Submit the conversion to a mirage2iso --serve instance", "SOCKET" },
+		{ "extract", 'x', 0, G_OPTION_ARG_STRING, &extract_path, "Extract a single file from the ISO9660 filesystem in the image", "PATH" },
 		{ "force", 'f', 0, G_OPTION_ARG_NONE, NULL, "Force replacing the guessed output file", NULL },
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &max_jobs, "Maximal number of concurrent --serve jobs (default: number of CPUs)", "N" },
+		{ "ls", 'l', 0, G_OPTION_ARG_NONE, &want_ls, "List files in the ISO9660 filesystem in the image", NULL },
+		{ "mount", 'm', 0, G_OPTION_ARG_NONE, &want_mount, "Expose the image as a read-only .iso file in <mountpoint> using FUSE", NULL },
+		{ "nbd-serve", 0, 0, G_OPTION_ARG_STRING, &nbd_addr, "Export the image over NBD on a Unix socket ([unix:]path) or loopback TCP ([tcp:][host:]port)", "ADDR" },
+		{ "output", 'o', 0, G_OPTION_ARG_FILENAME_ARRAY, &output_paths, "Output file ('-' for standard output); can be given multiple times to write the image into all of them from a single conversion", "FILE" },
 		{ "password", 'p', 0, G_OPTION_ARG_STRING, NULL, "Password for the encrypted image", "PASS" },
+		{ "prefetch", 0, 0, G_OPTION_ARG_INT, &prefetch_size, "How far ahead of the conversion to read the input files, in MiB (default: 32, 0 to disable)", "MIB" },
 		{ "quiet", 'q', 0, G_OPTION_ARG_NONE, &quiet, "Disable progress reporting, output only errors", NULL },
+		{ "restore", 0, 0, G_OPTION_ARG_NONE, &want_restore, "Reassemble an image from the --store chunk store, taking its recipe as input", NULL },
+		{ "sector-format", 0, 0, G_OPTION_ARG_INT, &sector_format, "Output sectors of 2048 bytes (.iso, default), or 2336 or 2352 bytes (.bin and .cue with all suitable tracks)", "BYTES" },
+		{ "sector-size", 0, 0, G_OPTION_ARG_INT, &sector_size, "Sector size of a raw image read from standard input (2048, 2336 or 2352)", "BYTES" },
+		{ "serve", 0, 0, G_OPTION_ARG_FILENAME, &serve_path, "Serve conversion requests on a Unix socket", "SOCKET" },
 		{ "session", 's', 0, G_OPTION_ARG_INT, NULL, "Session to use (default: the last one)", "N" },
+		{ "spill-size", 0, 0, G_OPTION_ARG_INT, &spill_size, "Maximal size of a temporary copy of standard input for formats needing random access, in MiB (default: 4096, 0 for no limit)", "MIB" },
+		{ "split-size", 0, 0, G_OPTION_ARG_CALLBACK, (gpointer) parse_split_size, "Write the image into parts of SIZE bytes (with K, M, G or T suffix, in binary units) named <out.iso>.000, .001, ... and a <out.iso>.manifest listing them", "SIZE" },
+		{ "stats", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, (gpointer) parse_stats, "Print per-phase timing, latency histograms and memory use to stderr when done", "text|json" },
 		{ "stdout", 'c', 0, G_OPTION_ARG_NONE, NULL, "Output the image into stdout instead of a file", NULL },
+		{ "store", 0, 0, G_OPTION_ARG_FILENAME, &store_path, "Output into a deduplicating chunk store and write a recipe instead of the .iso", "DIR" },
 		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Increase progress reporting verbosity", NULL },
 		{ "version", 'V', 0, G_OPTION_ARG_NONE, NULL, "Print program version and exit", NULL },
-		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, NULL, NULL, "<in> [<out.iso>]" },
+		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, NULL, NULL, "<in>|- [<out.iso>|<out-file>|<mountpoint>]" },
 		{ NULL }
 	};
 	GOptionContext *opt;
@@ -172,14 +699,14 @@ int main(int argc, char* argv[]) {
 
 	const gchar* out;
 	gchar* outbuf;
-	gint ret = !EX_OK;
+	gint ret;
 
-	opts[0].arg_data = &force;
-	opts[1].arg_data = &passbuf;
-	opts[3].arg_data = &session_num;
-	opts[4].arg_data = &use_stdout;
-	opts[6].arg_data = &want_version;
-	opts[7].arg_data = &newargv;
+	opts[4].arg_data = &force;
+	opts[10].arg_data = &passbuf;
+	opts[17].arg_data = &session_num;
+	opts[21].arg_data = &use_stdout;
+	opts[24].arg_data = &want_version;
+	opts[25].arg_data = &newargv;
 
 	opt = g_option_context_new(NULL);
 	g_option_context_add_main_entries(opt, opts, NULL);
@@ -211,9 +738,131 @@ int main(int argc, char* argv[]) {
 			g_printerr("--force has no effect when --stdout in use\n");
 	}
 
+	if ((miragecheck_enabled || store_path) && (serve_path || connect_path || want_mount
+				|| nbd_addr || want_ls || extract_path)) {
+		g_printerr("--check-edc and --store can be used only for plain conversion\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
+	if (sector_format && sector_format != 2048 && sector_format != 2336 && sector_format != 2352) {
+		g_printerr("--sector-format needs to be 2048, 2336 or 2352\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
+	if (sector_format > 2048 && (serve_path || connect_path || want_mount || nbd_addr
+				|| want_ls || extract_path || store_path || want_restore || use_stdout
+				|| miragecheck_enabled)) {
+		g_printerr("--sector-format=%d writes a .bin and a .cue, and can be used only for plain conversion\n",
+				sector_format);
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+	miragewrap_set_sector_format(sector_format > 2048 ? sector_format : 2048);
+
+	if (prefetch_size < 0) {
+		g_printerr("--prefetch needs to be 0 or more\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+	miragewrap_set_prefetch(prefetch_size);
+
+	if (cache_size <= 0) {
+		g_printerr("--cache-size needs to be 1 or more\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
+	if (spill_size < 0) {
+		g_printerr("--spill-size needs to be 0 or more\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
+	if (split_size && (serve_path || connect_path || want_mount || nbd_addr || want_ls
+				|| extract_path || store_path || use_stdout || sector_format > 2048
+				|| (newargv && newargv[0] && !strcmp(newargv[0], "-")))) {
+		g_printerr("--split-size can be used only for converting an image file into an .iso file\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
+	if (output_paths) {
+		const gchar *msg = NULL;
+		gint i, stdouts = 0;
+
+		for (i = 0; output_paths[i]; i++)
+			stdouts += !strcmp(output_paths[i], "-");
+
+		if (serve_path || connect_path || want_mount || nbd_addr || want_ls || extract_path
+				|| store_path || (newargv && newargv[0] && !strcmp(newargv[0], "-")))
+			msg = "--output can be used only for converting an image file\n";
+		else if (stdouts > 1)
+			msg = "--output can be '-' only once\n";
+		else if ((output_paths[1] || stdouts) && (sector_format > 2048 || split_size))
+			msg = "--sector-format and --split-size need a single --output file\n";
+
+		if (msg) {
+			g_printerr("%s", msg);
+			g_option_context_free(opt);
+			g_free(passbuf);
+			g_strfreev(newargv);
+			return EX_USAGE;
+		}
+	}
+
+	if (want_restore && (!store_path || miragecheck_enabled)) {
+		g_printerr("--restore needs --store and takes no --check-edc\n");
+		g_option_context_free(opt);
+		g_free(passbuf);
+		g_strfreev(newargv);
+		return EX_USAGE;
+	}
+
 	if (passbuf)
 		mirage_set_password(passbuf);
 
+	if (serve_path) {
+		g_option_context_free(opt);
+
+		if (newargv || connect_path || use_stdout) {
+			g_printerr("--serve takes no input, output or --connect options\n");
+			g_strfreev(newargv);
+			mirage_forget_password();
+			return EX_USAGE;
+		}
+
+		if (max_jobs <= 0)
+			max_jobs = g_get_num_processors();
+
+		if (!miragewrap_init())
+			return EX_SOFTWARE;
+
+		if (verbose)
+			version(TRUE);
+
+		/* jobs get passwords from clients, not from us */
+		mirage_forget_password();
+		ret = miragesrv_serve(serve_path, max_jobs, &convert_image);
+		miragewrap_free();
+		return ret;
+	}
+
 	if (!newargv || !newargv[0]) {
 		gchar* const helpmsg = g_option_context_get_help(opt, TRUE, NULL);
 		g_printerr("No input file specified\n%s", helpmsg);
@@ -225,16 +874,127 @@ int main(int argc, char* argv[]) {
 	}
 	g_option_context_free(opt);
 
+	if (connect_path && use_stdout) {
+		g_printerr("--stdout can't be used with --connect\n");
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return EX_USAGE;
+	}
+
+	if (sector_size && sector_size != 2048 && sector_size != 2336 && sector_size != 2352) {
+		g_printerr("--sector-size needs to be 2048, 2336 or 2352\n");
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return EX_USAGE;
+	}
+
+	if (!strcmp(newargv[0], "-")) {
+		if (want_mount || nbd_addr || want_ls || extract_path || connect_path || store_path
+				|| sector_format > 2048) {
+			g_printerr("Standard input can be used only for plain conversion\n");
+			ret = EX_USAGE;
+		} else if (use_stdout && newargv[1]) {
+			g_printerr("Output file can't be specified with --stdout\n");
+			ret = EX_USAGE;
+		} else if (!use_stdout && !newargv[1]) {
+			g_printerr("Output file needs to be specified when reading standard input\n");
+			ret = EX_USAGE;
+		} else
+			ret = convert_stream(newargv[1], session_num, sector_size, spill_size);
+
+		if (miragecheck_report(stderr) && ret == EX_OK)
+			ret = EX_DATAERR;
+		miragestats_report(stderr);
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return ret;
+	} else if (sector_size && !quiet)
+		g_printerr("--sector-size has no effect unless reading standard input\n");
+
+	if (want_mount || nbd_addr) {
+		if (want_mount && nbd_addr) {
+			g_printerr("--mount and --nbd-serve can't be used together\n");
+			ret = EX_USAGE;
+		} else if (use_stdout || connect_path) {
+			g_printerr("--mount and --nbd-serve can't be used with --stdout or --connect\n");
+			ret = EX_USAGE;
+		} else if (want_mount && (!newargv[1] || newargv[2])) {
+			g_printerr("--mount takes exactly an input file and a mountpoint\n");
+			ret = EX_USAGE;
+		} else if (nbd_addr && newargv[1]) {
+			g_printerr("--nbd-serve takes only an input file\n");
+			ret = EX_USAGE;
+		} else
+			ret = export_image(newargv[0], nbd_addr ? nbd_addr : newargv[1],
+					session_num, nbd_addr != NULL, cache_size);
+
+		miragestats_report(stderr);
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return ret;
+	}
+
+	if (want_ls || extract_path) {
+		out = newargv[1];
+		outbuf = NULL;
+
+		if ((want_ls && extract_path) || want_mount || nbd_addr || connect_path) {
+			g_printerr("--ls and --extract can't be used together or with other modes\n");
+			ret = EX_USAGE;
+		} else if (newargv[1] && (want_ls || use_stdout || newargv[2])) {
+			g_printerr("Too many arguments\n");
+			ret = EX_USAGE;
+		} else {
+			/* extract into the current directory by default */
+			if (extract_path && !out && !use_stdout) {
+				out = outbuf = g_path_get_basename(extract_path);
+
+				if (!force && g_file_test(out, G_FILE_TEST_EXISTS)) {
+					g_printerr("No output file specified and guessed filename matches existing file:\n\t%s\n", out);
+					ret = EX_USAGE;
+					out = NULL;
+				}
+			}
+
+			if (out || !extract_path || use_stdout)
+				ret = browse_image(newargv[0], extract_path, out, session_num, cache_size);
+		}
+
+		miragestats_report(stderr);
+		g_free(outbuf);
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return ret;
+	}
+
 	out = newargv[1];
 	outbuf = NULL;
+	if (output_paths) {
+		if (out || use_stdout) {
+			g_printerr("--output can't be used with an output file argument or --stdout\n");
+			g_strfreev(newargv);
+			mirage_forget_password();
+			return EX_USAGE;
+		}
+
+		/* a single one is just the output file */
+		if (!output_paths[1] && !strcmp(output_paths[0], "-"))
+			use_stdout = TRUE;
+		else
+			out = output_paths[0];
+	}
+
 	if (!out) {
 		if (!use_stdout) {
+			const gchar* const suffix = store_path && !want_restore ? "recipe"
+				: sector_format > 2048 ? "bin" : "iso";
 			const gchar* ext = strrchr(newargv[0], '.');
 
-			if (ext && !strcmp(ext, ".iso")) {
+			if (ext && !strcmp(&ext[1], suffix)) {
 				if (!force) {
-					g_printerr("Input file has .iso suffix and no output file specified\n"
-							"Either specify one or use --force to use '.iso.iso' output suffix\n");
+					g_printerr("Input file has .%s suffix and no output file specified\n"
+							"Either specify one or use --force to use '.%s.%s' output suffix\n",
+							suffix, suffix, suffix);
 					g_strfreev(newargv);
 					mirage_forget_password();
 					return EX_USAGE;
@@ -242,9 +1002,9 @@ int main(int argc, char* argv[]) {
 				ext = NULL;
 			}
 
-			outbuf = g_strdup_printf("%s.iso", newargv[0]);
+			outbuf = g_strdup_printf("%s.%s", newargv[0], suffix);
 			if (ext) /* replace the extension in the duplicated string */
-				strcpy(&outbuf[ext - newargv[0] + 1], "iso");
+				strcpy(&outbuf[ext - newargv[0] + 1], suffix);
 
 			if (!force) {
 				FILE *tmp = fopen(outbuf, "r");
@@ -269,50 +1029,40 @@ int main(int argc, char* argv[]) {
 		return EX_USAGE;
 	}
 
-	if (!miragewrap_init()) {
+	if (want_restore) {
+		ret = restore_image(newargv[0], out);
+		g_free(outbuf);
 		g_strfreev(newargv);
 		mirage_forget_password();
-		return EX_SOFTWARE;
+		return ret;
 	}
 
-	if (verbose)
-		version(TRUE);
-
-	if (!miragewrap_open(newargv[0], session_num)) {
-		miragewrap_free();
+	if (connect_path) {
+		ret = miragesrv_submit(connect_path, newargv[0], out, session_num, passbuf);
+		g_free(outbuf);
 		g_strfreev(newargv);
 		mirage_forget_password();
-		return EX_NOINPUT;
+		return ret;
 	}
-	if (verbose)
-		g_printerr("Input file '%s' open\n", newargv[0]);
 
-	{
-		gint tcount, i;
-
-		if (((tcount = miragewrap_get_track_count())) > 1 && !quiet)
-			g_printerr("NOTE: input session contains %d tracks; mirage2iso will read only the first usable one\n", tcount);
+	if (!miragewrap_init()) {
+		g_free(outbuf);
+		g_strfreev(newargv);
+		mirage_forget_password();
+		return EX_SOFTWARE;
+	}
 
-		for (i = 0; ret != EX_OK && i < tcount; i++) {
-			ret = output_track(out, i);
+	if (verbose)
+		version(TRUE);
 
-			if (ret != EX_OK && ret != EX_DATAERR) {
-				miragewrap_free();
-				g_strfreev(newargv);
-				mirage_forget_password();
-				return ret;
-			}
-		}
-	}
+	ret = convert_image(newargv[0], out, session_num);
+	if (miragecheck_report(stderr) && ret == EX_OK)
+		ret = EX_DATAERR;
+	miragestats_report(stderr);
 
 	g_free(outbuf);
-	if (ret != EX_OK) /* no valid track found */
-		g_printerr("No supported track found (audio CD?)\n");
-	else if (verbose)
-		g_printerr("Done\n");
-
 	miragewrap_free();
 	g_strfreev(newargv);
 	mirage_forget_password();
-	return EX_OK;
+	return ret;
 }
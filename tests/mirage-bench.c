@@ -0,0 +1,709 @@
+/* mirage2iso; benchmark image generator and runner
+ * (c) 2009-2015 Michał Górny
+ * Released under the terms of the 3-clause BSD license.
+ */
+
+#ifdef HAVE_CONFIG_H
+#	include "mirage-config.h"
+#endif
+
+#include <glib.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#	include <zlib.h>
+#endif
+
+#include "mirage-ecc.h"
+#include "mirage-sysexits.h"
+
+/* ISO9660 layout: PVD at 16, terminator at 17, path tables at 18
+ * and 19, root directory at 20, then files of up to 1 GiB each */
+#define BENCH_SECTOR 2048
+#define BENCH_RAW_SECTOR 2352
+#define BENCH_DATA_START 21
+#define BENCH_FILE_SECTORS (512 * 1024)
+#define BENCH_MAX_FILES 32
+/* sectors written at once */
+#define BENCH_BATCH 512
+
+typedef struct {
+	FILE *iso, *bin, *ecm, *nrg, *cso;
+	guint64 sectors;
+	guint32 ecm_edc;
+
+	guint32 *cso_index;
+	guint cso_align;
+	guint64 cso_pos;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+} bench_gen_t;
+
+/* Deterministic sector contents: runs of 32 sectors are either zeroed,
+ * random, or low-entropy text, so that compressed formats and zero
+ * detection see realistic input. */
+static void bench_fill_sector(guint8* const buf, const guint64 lba) {
+	guint64 x = (lba + 1) * 0x9e3779b97f4a7c15ULL;
+	gint i;
+
+	switch ((lba / 32) % 4) {
+		case 0:
+			memset(buf, 0, BENCH_SECTOR);
+			break;
+		case 1:
+			for (i = 0; i < BENCH_SECTOR; i += 8) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				memcpy(&buf[i], &x, 8);
+			}
+			break;
+		default:
+			for (i = 0; i < BENCH_SECTOR; i++) {
+				x ^= x << 13;
+				x ^= x >> 7;
+				x ^= x << 17;
+				buf[i] = "etaoin shrdlu\n"[x % 14];
+			}
+	}
+}
+
+static void bench_put_both16(guint8* const p, const guint16 v) {
+	p[0] = p[3] = v & 0xff;
+	p[1] = p[2] = v >> 8;
+}
+
+static void bench_put_both32(guint8* const p, const guint32 v) {
+	gint i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = p[7 - i] = v >> (8 * i);
+}
+
+static void bench_put_be32(guint8* const p, const guint32 v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void bench_put_be64(guint8* const p, const guint64 v) {
+	bench_put_be32(p, v >> 32);
+	bench_put_be32(&p[4], v);
+}
+
+static void bench_put_le32(guint8* const p, const guint32 v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static gsize bench_dir_record(guint8* const p, const guint32 lba, const guint32 size,
+		const gboolean dir, const gchar* const name, const gsize name_len) {
+	const gsize len = 33 + name_len + !(name_len % 2);
+
+	memset(p, 0, len);
+	p[0] = len;
+	bench_put_both32(&p[2], lba);
+	bench_put_both32(&p[10], size);
+	p[18] = 115; /* 2015 */
+	p[19] = p[20] = 1;
+	p[25] = dir ? 2 : 0;
+	bench_put_both16(&p[28], 1);
+	p[32] = name_len;
+	memcpy(&p[33], name, name_len);
+
+	return len;
+}
+
+/* Builds the filesystem metadata sector at lba, if there is one. */
+static void bench_system_sector(guint8* const buf, const guint64 lba, const guint64 sectors) {
+	const guint64 data_sectors = sectors - BENCH_DATA_START;
+	const guint files = (data_sectors + BENCH_FILE_SECTORS - 1) / BENCH_FILE_SECTORS;
+	guint8 *p;
+	guint i;
+
+	memset(buf, 0, BENCH_SECTOR);
+
+	switch (lba) {
+		case 16:
+		case 17:
+			buf[0] = lba == 16 ? 1 : 255;
+			memcpy(&buf[1], "CD001", 5);
+			buf[6] = 1;
+			if (lba == 17)
+				break;
+
+			memset(&buf[8], ' ', 64);
+			memcpy(&buf[40], "MIRAGE2ISO_BENCH", 16);
+			bench_put_both32(&buf[80], sectors);
+			bench_put_both16(&buf[120], 1);
+			bench_put_both16(&buf[124], 1);
+			bench_put_both16(&buf[128], BENCH_SECTOR);
+			bench_put_both32(&buf[132], 10);
+			bench_put_le32(&buf[140], 18);
+			bench_put_be32(&buf[148], 19);
+			bench_dir_record(&buf[156], 20, BENCH_SECTOR, TRUE, "", 1);
+			memset(&buf[190], ' ', 623);
+			for (i = 0; i < 4; i++)
+				memset(&buf[813 + i * 17], '0', 16);
+			buf[881] = 1;
+			break;
+		case 18:
+		case 19:
+			buf[0] = 1;
+			if (lba == 18)
+				bench_put_le32(&buf[2], 20);
+			else
+				bench_put_be32(&buf[2], 20);
+			buf[lba == 18 ? 6 : 7] = 1;
+			break;
+		case 20:
+			p = buf;
+			p += bench_dir_record(p, 20, BENCH_SECTOR, TRUE, "", 1);
+			p += bench_dir_record(p, 20, BENCH_SECTOR, TRUE, "\1", 1);
+			for (i = 0; i < files; i++) {
+				const guint64 left = data_sectors - (guint64) i * BENCH_FILE_SECTORS;
+				gchar name[16];
+
+				g_snprintf(name, sizeof(name), "BENCH%03u.DAT;1", i);
+				p += bench_dir_record(p, BENCH_DATA_START + i * BENCH_FILE_SECTORS,
+						MIN(left, BENCH_FILE_SECTORS) * BENCH_SECTOR, FALSE, name, strlen(name));
+			}
+			break;
+	}
+}
+
+static void bench_raw_header(guint8* const raw, const guint64 lba, const guint8 mode) {
+	const guint32 addr = lba + 150;
+	const guint8 msf[3] = { addr / 4500, (addr / 75) % 60, addr % 75 };
+	gint i;
+
+	raw[0] = raw[11] = 0;
+	memset(&raw[1], 0xff, 10);
+	for (i = 0; i < 3; i++)
+		raw[12 + i] = (msf[i] / 10) << 4 | (msf[i] % 10);
+	raw[15] = mode;
+}
+
+static void bench_raw_sector(guint8* const raw, const guint8* const data, const guint64 lba) {
+	bench_raw_header(raw, lba, 1);
+	memcpy(&raw[16], data, BENCH_SECTOR);
+	mirageecc_generate(raw, mirageecc_mode1);
+}
+
+/* Mode 2 sector; Form 2 ones carry 2324 bytes, the data repeated */
+static void bench_mode2_sector(guint8* const raw, const guint8* const data, const guint64 lba,
+		const gboolean form2) {
+	bench_raw_header(raw, lba, 2);
+	memset(&raw[16], 0, 8);
+	raw[18] = raw[22] = form2 ? 0x20 : 0x08;
+	memcpy(&raw[24], data, BENCH_SECTOR);
+	if (form2)
+		memcpy(&raw[24 + BENCH_SECTOR], data, 2324 - BENCH_SECTOR);
+	mirageecc_generate(raw, form2 ? mirageecc_mode2_form2 : mirageecc_mode2_form1);
+}
+
+/* ECM type/count header, as written by ecm(1) */
+static void bench_ecm_count(FILE* const f, const guint type, guint32 count) {
+	count--;
+	fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, f);
+	for (count >>= 5; count; count >>= 7)
+		fputc(((count >= 128) << 7) | (count & 127), f);
+}
+
+static FILE* bench_fopen(const gchar* const dir, const gchar* const name, const gchar* const mode) {
+	gchar* const fn = g_build_filename(dir, name, NULL);
+	FILE* const f = fopen(fn, mode);
+
+	if (!f)
+		g_printerr("Unable to open '%s': %s\n", fn, g_strerror(errno));
+
+	g_free(fn);
+	return f;
+}
+
+static gboolean bench_gen_open(bench_gen_t* const g, const gchar* const dir) {
+	FILE *cue;
+
+	if (!((g->iso = bench_fopen(dir, "bench.iso", "wb")))
+			|| !((g->bin = bench_fopen(dir, "bench.bin", "wb")))
+			|| !((g->ecm = bench_fopen(dir, "bench.bin.ecm", "wb")))
+			|| !((g->nrg = bench_fopen(dir, "bench.nrg", "wb")))
+			|| !((cue = bench_fopen(dir, "bench.cue", "w"))))
+		return FALSE;
+
+	fputs("FILE \"bench.bin\" BINARY\n  TRACK 01 MODE1/2352\n    INDEX 01 00:00:00\n", cue);
+	if (fclose(cue))
+		return FALSE;
+
+	/* all sectors in a single Mode 1 record */
+	fwrite("ECM", 1, 4, g->ecm);
+	bench_ecm_count(g->ecm, 1, g->sectors);
+
+#ifdef HAVE_ZLIB
+	if (!((g->cso = bench_fopen(dir, "bench.cso", "wb"))))
+		return FALSE;
+
+	/* offsets are stored as 31-bit values shifted by align */
+	while (((g->sectors * BENCH_SECTOR) >> g->cso_align) >= G_MAXINT32 / 2)
+		g->cso_align++;
+
+	g->cso_index = g_new0(guint32, g->sectors + 1);
+	g->cso_pos = 24 + (g->sectors + 1) * 4;
+	if (fseeko(g->cso, g->cso_pos, SEEK_SET))
+		return FALSE;
+	if (deflateInit2(&g->zs, 9, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return FALSE;
+#endif
+
+	return TRUE;
+}
+
+static gboolean bench_gen_cso(bench_gen_t* const g, const guint8* const data, const guint64 lba) {
+#ifdef HAVE_ZLIB
+	guint8 out[BENCH_SECTOR + 64];
+	const guint8 *block = out;
+	gsize len;
+
+	while (g->cso_pos % (1 << g->cso_align)) {
+		fputc(0, g->cso);
+		g->cso_pos++;
+	}
+
+	deflateReset(&g->zs);
+	g->zs.next_in = (guint8*) data;
+	g->zs.avail_in = BENCH_SECTOR;
+	g->zs.next_out = out;
+	g->zs.avail_out = sizeof(out);
+	if (deflate(&g->zs, Z_FINISH) != Z_STREAM_END)
+		return FALSE;
+
+	len = sizeof(out) - g->zs.avail_out;
+	g->cso_index[lba] = g->cso_pos >> g->cso_align;
+	if (len >= BENCH_SECTOR) {
+		block = data;
+		len = BENCH_SECTOR;
+		g->cso_index[lba] |= 0x80000000;
+	}
+
+	if (fwrite(block, 1, len, g->cso) != len)
+		return FALSE;
+	g->cso_pos += len;
+#endif
+
+	return TRUE;
+}
+
+static gboolean bench_gen_finish(bench_gen_t* const g) {
+	guint8 buf[64];
+	guint64 nrg_chunks = g->sectors * BENCH_SECTOR;
+	gboolean ret = TRUE;
+
+	/* ECM end marker and checksum of the decoded image */
+	bench_ecm_count(g->ecm, 0, 0);
+	bench_put_le32(buf, g->ecm_edc);
+	fwrite(buf, 1, 4, g->ecm);
+
+	/* NRG (Nero 5.5+) chunks: cue sheet, DAO info, session info, end */
+	memcpy(buf, "CUEX", 4);
+	bench_put_be32(&buf[4], 32);
+	fwrite(buf, 1, 8, g->nrg);
+	memset(buf, 0, 32);
+	buf[0] = buf[8] = buf[16] = buf[24] = 0x41;
+	buf[9] = buf[17] = 0x01;
+	buf[18] = 0x01;
+	bench_put_be32(&buf[4], -150);
+	bench_put_be32(&buf[12], -150);
+	buf[25] = 0xaa;
+	buf[26] = 0x01;
+	bench_put_be32(&buf[28], g->sectors);
+	fwrite(buf, 1, 32, g->nrg);
+
+	memcpy(buf, "DAOX", 4);
+	bench_put_be32(&buf[4], 22 + 42);
+	fwrite(buf, 1, 8, g->nrg);
+	/* header (first and last track), then the track: 2048-byte Mode 1,
+	 * no pregap stored, data from the beginning of the file */
+	memset(buf, 0, 64);
+	bench_put_be32(buf, 22 + 42);
+	buf[20] = buf[21] = 1;
+	buf[22 + 12] = BENCH_SECTOR >> 8;
+	bench_put_be64(&buf[22 + 34], g->sectors * BENCH_SECTOR);
+	fwrite(buf, 1, 64, g->nrg);
+
+	memcpy(buf, "SINF", 4);
+	bench_put_be32(&buf[4], 4);
+	bench_put_be32(&buf[8], 1);
+	memcpy(&buf[12], "END!", 4);
+	bench_put_be32(&buf[16], 0);
+	memcpy(&buf[20], "NER5", 4);
+	bench_put_be64(&buf[24], nrg_chunks);
+	fwrite(buf, 1, 32, g->nrg);
+
+#ifdef HAVE_ZLIB
+	if (g->cso) {
+		guint64 i;
+
+		while (g->cso_pos % (1 << g->cso_align)) {
+			fputc(0, g->cso);
+			g->cso_pos++;
+		}
+		g->cso_index[g->sectors] = g->cso_pos >> g->cso_align;
+
+		memset(buf, 0, 24);
+		memcpy(buf, "CISO", 4);
+		bench_put_le32(&buf[8], g->sectors * BENCH_SECTOR);
+		bench_put_le32(&buf[12], (g->sectors * BENCH_SECTOR) >> 32);
+		bench_put_le32(&buf[16], BENCH_SECTOR);
+		buf[20] = 1;
+		buf[21] = g->cso_align;
+
+		if (fseeko(g->cso, 0, SEEK_SET) || fwrite(buf, 1, 24, g->cso) != 24)
+			ret = FALSE;
+		for (i = 0; ret && i <= g->sectors; i++) {
+			bench_put_le32(buf, g->cso_index[i]);
+			ret = fwrite(buf, 1, 4, g->cso) == 4;
+		}
+		deflateEnd(&g->zs);
+	}
+#endif
+
+	return ret;
+}
+
+static gboolean bench_fclose(FILE* const f) {
+	if (f && fclose(f)) {
+		g_printerr("fclose() failed: %s\n", g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Writes bench.iso and the same image as .bin/.cue, .bin.ecm, .nrg
+ * and .cso (with zlib), in a single pass. */
+static gint bench_gen(const gchar* const dir, const gint size_mib) {
+	bench_gen_t g;
+	guint8 *data, *raw;
+	gboolean ok;
+	guint64 lba;
+
+	if (size_mib < 1 || size_mib > BENCH_MAX_FILES * 1024) {
+		g_printerr("Image size needs to be between 1 and %d MiB\n", BENCH_MAX_FILES * 1024);
+		return EX_USAGE;
+	}
+
+	memset(&g, 0, sizeof(g));
+	g.sectors = (guint64) size_mib * 1024 * 1024 / BENCH_SECTOR;
+	data = g_malloc(BENCH_BATCH * BENCH_SECTOR);
+	raw = g_malloc(BENCH_BATCH * BENCH_RAW_SECTOR);
+
+	ok = bench_gen_open(&g, dir);
+	for (lba = 0; ok && lba < g.sectors; lba += BENCH_BATCH) {
+		const guint n = MIN(BENCH_BATCH, g.sectors - lba);
+		guint i;
+
+		for (i = 0; ok && i < n; i++) {
+			guint8* const d = &data[i * BENCH_SECTOR];
+			guint8* const r = &raw[i * BENCH_RAW_SECTOR];
+
+			if (lba + i < BENCH_DATA_START)
+				bench_system_sector(d, lba + i, g.sectors);
+			else
+				bench_fill_sector(d, lba + i);
+
+			bench_raw_sector(r, d, lba + i);
+			g.ecm_edc = mirageecc_edc(g.ecm_edc, r, BENCH_RAW_SECTOR);
+			ok = fwrite(&r[12], 1, 3, g.ecm) == 3 && fwrite(d, 1, BENCH_SECTOR, g.ecm) == BENCH_SECTOR
+				&& bench_gen_cso(&g, d, lba + i);
+		}
+
+		ok = ok && fwrite(data, BENCH_SECTOR, n, g.iso) == n
+			&& fwrite(data, BENCH_SECTOR, n, g.nrg) == n
+			&& fwrite(raw, BENCH_RAW_SECTOR, n, g.bin) == n;
+	}
+
+	ok = ok && bench_gen_finish(&g);
+	if (!ok)
+		g_printerr("Generating images failed: %s\n", g_strerror(errno));
+
+	ok = bench_fclose(g.iso) && ok;
+	ok = bench_fclose(g.bin) && ok;
+	ok = bench_fclose(g.ecm) && ok;
+	ok = bench_fclose(g.nrg) && ok;
+	ok = bench_fclose(g.cso) && ok;
+
+	g_free(g.cso_index);
+	g_free(data);
+	g_free(raw);
+	return ok ? EX_OK : EX_IOERR;
+}
+
+static void bench_cue_msf(GString* const str, const gchar* const prefix, const guint64 frames) {
+	g_string_append_printf(str, "%s %02d:%02d:%02d\n", prefix,
+			(gint) (frames / (60 * 75)), (gint) (frames / 75 % 60), (gint) (frames % 75));
+}
+
+/* Writes the multi-track fixture for perform-test: 05_mode2.bin/.cue with
+ * a mixed Mode 2 track (every 4th sector Form 2), an audio track and
+ * another mixed one, both after a 2-second pregap, along with the expected
+ * --sector-format=2336 output in 05_mode2.bin.2336 and 05_mode2.cue.2336. */
+static gint bench_gen_mode2(const gchar* const dir) {
+	static const struct {
+		const gchar *mode;
+		gint sectors, pregap;
+	} tracks[] = {
+		{ "MODE2/2352", 300, 0 },
+		{ "AUDIO", 150, 150 },
+		{ "MODE2/2352", 100, 150 }
+	};
+	GString* const cue = g_string_new("FILE \"05_mode2.bin\" BINARY\n");
+	GString* const cue2336 = g_string_new("FILE \"05_mode2.bin\" BINARY\n");
+	guint8 data[BENCH_SECTOR], raw[BENCH_RAW_SECTOR];
+	guint64 lba = 0, lba2336 = 0, addr = 0;
+	GError *err = NULL;
+	FILE *bin, *bin2336;
+	gchar *fn;
+	gboolean ok;
+	guint t;
+
+	bin = bench_fopen(dir, "05_mode2.bin", "wb");
+	bin2336 = bench_fopen(dir, "05_mode2.bin.2336", "wb");
+	ok = bin && bin2336;
+
+	for (t = 0; ok && t < G_N_ELEMENTS(tracks); t++) {
+		const gboolean audio = !strcmp(tracks[t].mode, "AUDIO");
+		gint i;
+
+		g_string_append_printf(cue, "  TRACK %02u %s\n", t + 1, tracks[t].mode);
+		if (tracks[t].pregap)
+			bench_cue_msf(cue, "    PREGAP", tracks[t].pregap);
+		bench_cue_msf(cue, "    INDEX 01", lba);
+		if (!audio) {
+			g_string_append_printf(cue2336, "  TRACK %02u MODE2/2336\n", t + 1);
+			if (tracks[t].pregap && lba2336)
+				bench_cue_msf(cue2336, "    PREGAP", tracks[t].pregap);
+			bench_cue_msf(cue2336, "    INDEX 01", lba2336);
+		}
+
+		addr += tracks[t].pregap;
+		for (i = 0; ok && i < tracks[t].sectors; i++, lba++, addr++) {
+			bench_fill_sector(data, lba);
+			if (audio) {
+				memcpy(raw, data, BENCH_SECTOR);
+				bench_fill_sector(data, lba + 1000000);
+				memcpy(&raw[BENCH_SECTOR], data, BENCH_RAW_SECTOR - BENCH_SECTOR);
+			} else {
+				bench_mode2_sector(raw, data, addr, i % 4 == 3);
+				ok = fwrite(&raw[16], 1, 2336, bin2336) == 2336;
+				lba2336++;
+			}
+
+			ok = ok && fwrite(raw, 1, BENCH_RAW_SECTOR, bin) == BENCH_RAW_SECTOR;
+		}
+	}
+
+	if (!ok)
+		g_printerr("Generating images failed: %s\n", g_strerror(errno));
+	ok = bench_fclose(bin) && ok;
+	ok = bench_fclose(bin2336) && ok;
+
+	fn = g_build_filename(dir, "05_mode2.cue.2336", NULL);
+	ok = ok && g_file_set_contents(fn, cue2336->str, cue2336->len, &err);
+	g_free(fn);
+	/* the .cue is the make target, so it comes last */
+	fn = g_build_filename(dir, "05_mode2.cue", NULL);
+	ok = ok && g_file_set_contents(fn, cue->str, cue->len, &err);
+	g_free(fn);
+	if (err) {
+		g_printerr("Unable to write CUE sheet: %s\n", err->message);
+		g_error_free(err);
+	}
+
+	g_string_free(cue, TRUE);
+	g_string_free(cue2336, TRUE);
+	return ok ? EX_OK : EX_IOERR;
+}
+
+/* Runs the command, appending a result line to the results file:
+ * format, options, MB/s, wall, user and system seconds, peak RSS, status */
+static gint bench_run(const gchar* const results, const gchar* const format,
+		const gchar* const opts, const guint64 bytes, gchar** const argv) {
+	struct rusage ru;
+	gint64 start, end;
+	gdouble wall;
+	FILE *f;
+	pid_t pid;
+	int status;
+
+	start = g_get_monotonic_time();
+	if (((pid = fork())) == -1) {
+		g_printerr("fork() failed: %s\n", g_strerror(errno));
+		return EX_OSERR;
+	} else if (!pid) {
+		execvp(argv[0], argv);
+		g_printerr("Unable to run '%s': %s\n", argv[0], g_strerror(errno));
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) == -1) {
+		g_printerr("wait4() failed: %s\n", g_strerror(errno));
+		return EX_OSERR;
+	}
+	end = g_get_monotonic_time();
+	wall = (end - start) / 1e6;
+
+	if (!((f = fopen(results, "a")))) {
+		g_printerr("Unable to open '%s': %s\n", results, g_strerror(errno));
+		return EX_CANTCREAT;
+	}
+
+	fprintf(f, "%s\t%s\t%.1f\t%.3f\t%.3f\t%.3f\t%ld\t%d\n", format, opts,
+			bytes / wall / 1e6, wall,
+			ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+			ru.ru_maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+
+	return bench_fclose(f) ? EX_OK : EX_IOERR;
+}
+
+typedef struct {
+	gchar *key;
+	gdouble mbps, cpu;
+	glong rss;
+	gint status;
+} bench_result_t;
+
+static GArray* bench_load(const gchar* const fn) {
+	GArray *ret;
+	gchar line[1024];
+	FILE *f;
+
+	if (!((f = fopen(fn, "r")))) {
+		g_printerr("Unable to open '%s': %s\n", fn, g_strerror(errno));
+		return NULL;
+	}
+
+	ret = g_array_new(FALSE, FALSE, sizeof(bench_result_t));
+	while (fgets(line, sizeof(line), f)) {
+		gchar** const fields = g_strsplit(g_strchomp(line), "\t", 0);
+
+		if (g_strv_length(fields) == 8 && g_ascii_isdigit(fields[2][0])) {
+			bench_result_t r;
+
+			r.key = g_strdup_printf("%s %s", fields[0], fields[1]);
+			r.mbps = g_ascii_strtod(fields[2], NULL);
+			r.cpu = g_ascii_strtod(fields[4], NULL) + g_ascii_strtod(fields[5], NULL);
+			r.rss = atol(fields[6]);
+			r.status = atoi(fields[7]);
+			g_array_append_val(ret, r);
+		}
+
+		g_strfreev(fields);
+	}
+
+	fclose(f);
+	return ret;
+}
+
+static void bench_free(GArray* const results) {
+	guint i;
+
+	for (i = 0; i < results->len; i++)
+		g_free(g_array_index(results, bench_result_t, i).key);
+	g_array_free(results, TRUE);
+}
+
+/* Compares results against a baseline; throughput drops and CPU time
+ * or peak RSS increases over threshold percent count as regressions. */
+static gint bench_compare(const gchar* const baseline_fn, const gchar* const results_fn,
+		const gdouble threshold) {
+	GArray *baseline, *results;
+	const gdouble t = threshold / 100;
+	gint regressions = 0;
+	guint i, j;
+
+	if (!((baseline = bench_load(baseline_fn))))
+		return EX_NOINPUT;
+	if (!((results = bench_load(results_fn)))) {
+		bench_free(baseline);
+		return EX_NOINPUT;
+	}
+
+	printf("%-24s %10s %10s %8s %8s  %s\n", "", "MB/s", "baseline", "CPU", "RSS", "");
+	for (i = 0; i < results->len; i++) {
+		const bench_result_t* const r = &g_array_index(results, bench_result_t, i);
+		const bench_result_t *b = NULL;
+		const gchar *verdict = "ok";
+
+		for (j = 0; !b && j < baseline->len; j++) {
+			if (!strcmp(g_array_index(baseline, bench_result_t, j).key, r->key))
+				b = &g_array_index(baseline, bench_result_t, j);
+		}
+
+		if (!b) {
+			printf("%-24s %10.1f %10s %8s %8s  new\n", r->key, r->mbps, "-", "-", "-");
+			continue;
+		}
+
+		if (r->status && !b->status)
+			verdict = "REGRESSION (fails)";
+		else if (r->mbps < b->mbps * (1 - t))
+			verdict = "REGRESSION (throughput)";
+		else if (r->cpu > b->cpu * (1 + t))
+			verdict = "REGRESSION (CPU time)";
+		else if (r->rss > b->rss * (1 + t))
+			verdict = "REGRESSION (peak RSS)";
+
+		if (verdict[0] == 'R')
+			regressions++;
+
+		printf("%-24s %10.1f %10.1f %+7.0f%% %+7.0f%%  %s\n", r->key, r->mbps, b->mbps,
+				b->cpu ? 100 * (r->cpu / b->cpu - 1) : 0.0,
+				b->rss ? 100 * ((gdouble) r->rss / b->rss - 1) : 0.0, verdict);
+	}
+
+	bench_free(baseline);
+	bench_free(results);
+
+	if (regressions) {
+		printf("%d regression(s) over %.0f%%\n", regressions, threshold);
+		return EX_SOFTWARE;
+	}
+
+	return EX_OK;
+}
+
+static void usage(void) {
+	g_printerr("Usage: mirage-bench gen <dir> <size-mib>\n"
+			"       mirage-bench mode2 <dir>\n"
+			"       mirage-bench run <results.tsv> <format> <options> <bytes> <command>...\n"
+			"       mirage-bench compare <baseline.tsv> <results.tsv> [<threshold-percent>]\n");
+}
+
+int main(int argc, char* argv[]) {
+	if (argc == 4 && !strcmp(argv[1], "gen"))
+		return bench_gen(argv[2], atoi(argv[3]));
+	else if (argc == 3 && !strcmp(argv[1], "mode2"))
+		return bench_gen_mode2(argv[2]);
+	else if (argc >= 7 && !strcmp(argv[1], "run"))
+		return bench_run(argv[2], argv[3], argv[4], g_ascii_strtoull(argv[5], NULL, 10), &argv[6]);
+	else if ((argc == 4 || argc == 5) && !strcmp(argv[1], "compare"))
+		return bench_compare(argv[2], argv[3], argc == 5 ? g_ascii_strtod(argv[4], NULL) : 10);
+
+	usage();
+	return EX_USAGE;
+}